@@ -0,0 +1,448 @@
+/*
+ * Headless keystroke benchmark for xul.
+ *
+ * Builds xul.c against the stand-in API in yed.c, opens a buffer
+ * (generated, or read from a file), and replays scripted key streams
+ * through the same path the editor uses: KEY_PRE_PRESS, the binding,
+ * then a draw of the visible lines.  Each phase reports keys/second.
+ *
+ *     ./build.sh bench [-l lines] [-f file] [-n rounds] [-b bindings] [-k keys] [-d rounds]
+ *
+ * -k replays a recorded key trace as one more phase: keys written as
+ * for xul-bind ("j", "ctrl-w", "esc", ...), separated by white space.
+ * -d runs xul-bench-dispatch with that many rounds after the phases.
+ *
+ * Before the phases, a few edits are checked on a scratch buffer; any
+ * that fail are reported and make the exit status 1.
+ */
+#include <yed/plugin.h>
+
+#include <time.h>
+#include <unistd.h>
+
+static int         n_lines    = 20000;
+static int         n_rounds   = 3;
+static int         n_bindings = 2000;
+static const char *path;
+static char       *trace_keys;
+static char       *dispatch_rounds;
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static void gen_buffer(yed_buffer *buff, int lines) {
+    static const char *words[] = {
+        "int", "return", "if", "else", "for", "while", "buffer", "frame",
+        "cursor", "line", "col", "row", "glyph", "key", "mode", "xul",
+    };
+    char     text[256];
+    int      len;
+    int      row;
+    int      i;
+    unsigned seed;
+
+    seed = 12345;
+
+    for (row = 1; row <= lines; row += 1) {
+        len = 0;
+
+        if (row % 8 == 0) {
+            stub_buffer_append_line(buff, "", 0);
+            continue;
+        }
+
+        len += snprintf(text + len, sizeof(text) - len, "    ");
+        for (i = 0; i < 6; i += 1) {
+            seed = (seed * 1103515245) + 12345;
+            len += snprintf(text + len, sizeof(text) - len, "%s%s",
+                            words[(seed >> 16) % 16],
+                            i == 2 ? "(" : i == 4 ? ") { " : " ");
+        }
+        len += snprintf(text + len, sizeof(text) - len, "}; /* %d */", row);
+
+        stub_buffer_append_line(buff, text, len);
+    }
+}
+
+static int load_file(yed_buffer *buff, const char *p) {
+    FILE   *f;
+    char   *line;
+    size_t  cap;
+    ssize_t len;
+
+    if ((f = fopen(p, "r")) == NULL) { return 0; }
+
+    line = NULL;
+    cap  = 0;
+    while ((len = getline(&line, &cap, f)) >= 0) {
+        if (len && line[len - 1] == '\n') { len -= 1; }
+        stub_buffer_append_line(buff, line, len);
+    }
+
+    free(line);
+    fclose(f);
+
+    return 1;
+}
+
+static char *read_keys(const char *p) {
+    FILE *f;
+    char *buf;
+    long  len;
+    long  i;
+
+    if ((f = fopen(p, "r")) == NULL) { return NULL; }
+
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    buf = malloc(len + 1);
+    len = fread(buf, 1, len, f);
+    buf[len] = 0;
+    fclose(f);
+
+    for (i = 0; i < len; i += 1) {
+        if (isspace((unsigned char)buf[i])) { buf[i] = ' '; }
+    }
+
+    return buf;
+}
+
+/* Space separated keys, written as for xul-bind. */
+static int press(const char *str) {
+    int         keys[MAX_SEQ_LEN];
+    char        tok[64];
+    int         n;
+    int         i;
+    int         len;
+    int         total;
+
+    total = 0;
+
+    while (*str) {
+        while (*str == ' ') { str += 1; }
+        if (!*str) { break; }
+
+        for (len = 0; str[len] && str[len] != ' ' && len < (int)sizeof(tok) - 1; len += 1) { }
+        memcpy(tok, str, len);
+        tok[len] = 0;
+        str     += len;
+
+        if ((n = yed_string_to_keys(tok, keys)) <= 0) {
+            fprintf(stderr, "bad key '%s'\n", tok);
+            exit(1);
+        }
+
+        for (i = 0; i < n; i += 1) {
+            stub_press_key(keys[i]);
+            stub_draw();
+            total += 1;
+        }
+    }
+
+    return total;
+}
+
+/* Type text one key at a time; spaces and newlines included. */
+static int type(const char *text) {
+    int total;
+
+    for (total = 0; *text; text += 1, total += 1) {
+        stub_press_key(*text == '\n' ? ENTER : *text);
+        stub_draw();
+    }
+
+    return total;
+}
+
+typedef struct {
+    const char *name;
+    int       (*run)(int round);
+} phase;
+
+static int phase_nav(int round) {
+    int total;
+    int i;
+
+    total = 0;
+
+    for (i = 0; i < 200; i += 1) {
+        total += press("j j j j k k w w w b b e e { } } { 5 j 3 k 2 w 0 $ 0");
+    }
+    total += press("G g g");
+
+    return total;
+}
+
+static int phase_insert(int round) {
+    int total;
+    int i;
+
+    total = 0;
+
+    for (i = 0; i < 200; i += 1) {
+        total += press("1 0 j A");
+        total += type(" hello(world, 42);");
+        total += press("esc A");
+        total += type("\nint x = y + z; /* more */");
+        total += press("esc");
+    }
+
+    return total;
+}
+
+static int phase_keymap(int round) {
+    static int  bound;
+    char        keys[64];
+    char        cmd[16];
+    char       *args[4];
+    int         total;
+    int         i;
+
+    if (!bound) {
+        /*
+         * Lots of user bindings that share prefixes with each other
+         * and with nothing that is typed below.
+         */
+        for (i = 0; i < n_bindings; i += 1) {
+            snprintf(keys, sizeof(keys), "ctrl-x %c %c %c", 'a' + (i % 26), 'a' + ((i / 26) % 26), 'a' + ((i / 676) % 26));
+            snprintf(cmd,  sizeof(cmd),  "select-off");
+            args[0] = "normal";
+            args[1] = keys;
+            args[2] = cmd;
+            yed_execute_command("xul-bind", 3, args);
+        }
+        bound = 1;
+    }
+
+    total = 0;
+
+    for (i = 0; i < 500; i += 1) {
+        total += press("i esc j a esc k ctrl-x a b c l h");
+    }
+
+    return total;
+}
+
+static int phase_dot(int round) {
+    int total;
+    int i;
+
+    total  = press("g g 4 j A");
+    total += type(" /* dot */");
+    total += press("esc");
+
+    for (i = 0; i < 300; i += 1) {
+        total += press("j .");
+    }
+    total += press("5 0 0 .");
+
+    return total;
+}
+
+static int phase_ops(int round) {
+    int total;
+    int i;
+
+    total = press("g g");
+
+    for (i = 0; i < 200; i += 1) {
+        total += press("j d w y y p c i w");
+        total += type("renamed");
+        total += press("esc d i ( u 2 j y i p");
+    }
+
+    return total;
+}
+
+/* Pump with no input until a chunked operator is done; counts the pumps. */
+static int pump_idle(void) {
+    int n;
+
+    for (n = 0; yed_get_var("xul-progress") != NULL; n += 1) {
+        stub_pump();
+    }
+
+    return n;
+}
+
+static int phase_chunked(int round) {
+    char *save;
+    int   total;
+
+    save = strdup(yed_get_var("xul-chunked-op-lines"));
+    yed_set_var("xul-chunked-op-lines", "1000");
+
+    total  = press("g g V 5 0 0 0 j y");
+    pump_idle();
+    total += press("G p");
+    pump_idle();
+    total += press("V 5 0 0 0 k d");
+    pump_idle();
+
+    yed_set_var("xul-chunked-op-lines", save);
+    free(save);
+
+    return total;
+}
+
+static int phase_trace(int round) {
+    return trace_keys ? press(trace_keys) : 0;
+}
+
+/*
+ * Keys pressed on a fresh 20 line buffer ("l1" .. "l20") with the
+ * cursor on line 1, and what should be left afterwards.
+ */
+typedef struct {
+    const char *keys;
+    int         lines;
+    int         cursor_row;
+    int         yank_lines;
+} check;
+
+static check checks[] = {
+    /* A count on G with an operator names the line, wherever it is typed. */
+    { "9 g d 5 G",   15, 5, 5  },
+    { "9 g 5 d G",   15, 5, 5  },
+    { "9 g y 5 G",   20, 5, 5  },
+    { "5 g 2 d 3 G", 18, 5, 2  },
+    { "9 g d G",      8, 8, 12 },
+};
+
+static int run_checks(void) {
+    yed_buffer *buff;
+    check      *c;
+    char        text[16];
+    int         failed;
+    int         row;
+    int         i;
+    int         yank_lines;
+
+    failed = 0;
+
+    for (i = 0; i < (int)(sizeof(checks) / sizeof(checks[0])); i += 1) {
+        c    = checks + i;
+        buff = stub_make_buffer("check.c");
+        for (row = 1; row <= 20; row += 1) {
+            stub_buffer_append_line(buff, text, snprintf(text, sizeof(text), "l%d", row));
+        }
+        stub_open(buff);
+        stub_draw();
+
+        press(c->keys);
+        press("esc");
+
+        yank_lines = yed_buff_n_lines(yed_get_buffer("*yank"));
+
+        if (yed_buff_n_lines(buff)         != c->lines
+        ||  ys->active_frame->cursor_line != c->cursor_row
+        ||  yank_lines                    != c->yank_lines) {
+
+            fprintf(stderr, "check '%s': %d lines, cursor on %d, %d yanked; expected %d, %d, %d\n",
+                    c->keys, yed_buff_n_lines(buff), ys->active_frame->cursor_line, yank_lines,
+                    c->lines, c->cursor_row, c->yank_lines);
+            failed += 1;
+        }
+    }
+
+    return failed;
+}
+
+static phase phases[] = {
+    { "nav",     phase_nav     },
+    { "insert",  phase_insert  },
+    { "keymap",  phase_keymap  },
+    { "dot",     phase_dot     },
+    { "ops",     phase_ops     },
+    { "chunked", phase_chunked },
+    { "trace",   phase_trace   },
+};
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-l lines] [-f file] [-n rounds] [-b bindings] [-k keys] [-d rounds]\n", argv0);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int                 opt;
+    yed_buffer         *buff;
+    unsigned long long  start;
+    unsigned long long  ns;
+    unsigned long long  best;
+    int                 keys;
+    int                 round;
+    int                 p;
+    int                 failed;
+
+    while ((opt = getopt(argc, argv, "l:f:n:b:k:d:")) != -1) {
+        switch (opt) {
+            case 'l': n_lines    = atoi(optarg); break;
+            case 'f': path       = optarg;       break;
+            case 'n': n_rounds   = atoi(optarg); break;
+            case 'b': n_bindings = atoi(optarg); break;
+            case 'd': dispatch_rounds = optarg;  break;
+            case 'k':
+                if ((trace_keys = read_keys(optarg)) == NULL) {
+                    fprintf(stderr, "can't read '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            default:  usage(argv[0]);
+        }
+    }
+    if (n_lines <= 0 || n_rounds <= 0) { usage(argv[0]); }
+
+    stub_boot();
+
+    failed = run_checks();
+
+    buff = stub_make_buffer(path ? path : "bench.c");
+    if (path) {
+        if (!load_file(buff, path)) {
+            fprintf(stderr, "can't read '%s'\n", path);
+            return 1;
+        }
+    } else {
+        gen_buffer(buff, n_lines);
+    }
+
+    stub_open(buff);
+    stub_draw();
+
+    printf("%-8s %10s %12s %14s\n", "phase", "keys", "best ms", "keys/sec");
+
+    for (p = 0; p < (int)(sizeof(phases) / sizeof(phases[0])); p += 1) {
+        if (phases[p].run == phase_trace && trace_keys == NULL) { continue; }
+
+        best = 0;
+        keys = 0;
+
+        for (round = 0; round < n_rounds; round += 1) {
+            start = now_ns();
+            keys  = phases[p].run(round);
+            ns    = now_ns() - start;
+
+            if (best == 0 || ns < best) { best = ns; }
+        }
+
+        printf("%-8s %10d %12.2f %14.0f\n",
+               phases[p].name, keys, best / 1e6, keys / (best / 1e9));
+    }
+
+    if (dispatch_rounds != NULL) {
+        yed_execute_command("xul-bench-dispatch", 1, &dispatch_rounds);
+    }
+
+    printf("%d lines, %d errors, %d failed checks\n", yed_buff_n_lines(buff), stub_n_errors(), failed);
+
+    stub_unload();
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,1312 @@
+/*
+ * Headless implementation of the parts of yed's plugin API that xul
+ * uses.  One frame, any number of buffers, a command table with the
+ * built-in commands xul runs, key bindings and sequences, variables,
+ * and events.  Drawing only fires the draw events for the lines that
+ * would be on screen.
+ */
+#include <yed/plugin.h>
+
+#include <stdarg.h>
+
+#define FRAME_HEIGHT (40)
+#define FRAME_WIDTH  (120)
+#define TAB_WIDTH    (4)
+
+/* Arrays */
+
+array_t _array_make(int elem_size) {
+    array_t a;
+
+    a.data      = NULL;
+    a.elem_size = elem_size;
+    a.used      = 0;
+    a.capacity  = 0;
+
+    return a;
+}
+
+static void array_grow(array_t *a, int n) {
+    if (a->used + n <= a->capacity) { return; }
+
+    if (a->capacity == 0) { a->capacity = 16; }
+    while (a->capacity < a->used + n) { a->capacity *= 2; }
+
+    a->data = realloc(a->data, (size_t)a->capacity * a->elem_size);
+}
+
+void *_array_push(array_t *a, void *elem) {
+    void *slot;
+
+    array_grow(a, 1);
+    slot = (char*)a->data + ((size_t)a->used * a->elem_size);
+    memcpy(slot, elem, a->elem_size);
+    a->used += 1;
+
+    return slot;
+}
+
+void *_array_insert(array_t *a, int idx, void *elem) {
+    char *slot;
+
+    if (idx >= a->used) { return _array_push(a, elem); }
+
+    array_grow(a, 1);
+    slot = (char*)a->data + ((size_t)idx * a->elem_size);
+    memmove(slot + a->elem_size, slot, (size_t)(a->used - idx) * a->elem_size);
+    memcpy(slot, elem, a->elem_size);
+    a->used += 1;
+
+    return slot;
+}
+
+void _array_delete(array_t *a, int idx) {
+    char *slot;
+
+    if (idx < 0 || idx >= a->used) { return; }
+
+    slot = (char*)a->data + ((size_t)idx * a->elem_size);
+    memmove(slot, slot + a->elem_size, (size_t)(a->used - idx - 1) * a->elem_size);
+    a->used -= 1;
+}
+
+void _array_push_n(array_t *a, void *elems, int n) {
+    if (n <= 0) { return; }
+
+    array_grow(a, n);
+    memcpy((char*)a->data + ((size_t)a->used * a->elem_size), elems, (size_t)n * a->elem_size);
+    a->used += n;
+}
+
+void _array_zero_term(array_t *a) {
+    array_grow(a, 1);
+    memset((char*)a->data + ((size_t)a->used * a->elem_size), 0, a->elem_size);
+}
+
+/* State */
+
+typedef struct {
+    char        *name;
+    yed_command  fn;
+} command_entry;
+
+typedef struct {
+    int len;
+    int keys[MAX_SEQ_LEN];
+    int key;
+} key_sequence;
+
+typedef struct {
+    char *name;
+    char *val;
+} var_entry;
+
+static yed_state        state;
+yed_state              *ys = &state;
+static yed_frame        frame;
+static array_t          buffers;   /* yed_buffer* */
+static array_t          commands;  /* command_entry */
+static array_t          sequences; /* key_sequence */
+static array_t          vars;      /* var_entry */
+static array_t          handlers[N_EVENTS];
+static yed_key_binding *bindings[VIRT_KEY_MAX];
+static void           (*unload_fn)(yed_plugin*);
+static yed_buffer      *yank;      /* "*yank", BUFF_YANK_LINES for line yanks */
+static int              undo_depth;
+static int              n_errors;
+static yed_glyph        end_glyph = { .c = ' ' };
+
+int yed_plugin_boot(yed_plugin *self);
+
+/* Events */
+
+static void fire(yed_event *event) {
+    yed_event_handler *h;
+
+    array_traverse(handlers[event->kind], h) {
+        h->fn(event);
+    }
+}
+
+static void fire_mod(yed_buffer *buff, int row, int mod) {
+    yed_event event;
+
+    buff->flags |= BUFF_MODIFIED;
+
+    memset(&event, 0, sizeof(event));
+    event.kind           = EVENT_BUFFER_POST_MOD;
+    event.frame          = ys->active_frame;
+    event.buffer         = buff;
+    event.row            = row;
+    event.buff_mod_event = mod;
+    fire(&event);
+}
+
+/* Glyphs and lines */
+
+int yed_get_glyph_len(yed_glyph *g) {
+    if (g->u_c < 0x80)           { return 1; }
+    if ((g->u_c & 0xE0) == 0xC0) { return 2; }
+    if ((g->u_c & 0xF0) == 0xE0) { return 3; }
+    if ((g->u_c & 0xF8) == 0xF0) { return 4; }
+    return 1;
+}
+
+int yed_get_glyph_width(yed_glyph *g) {
+    return g->c == '\t' ? TAB_WIDTH : 1;
+}
+
+static void line_recompute(yed_line *line) {
+    char *bytes;
+    int   idx;
+    int   len;
+
+    bytes              = array_data(line->glyphs);
+    len                = array_len(line->glyphs);
+    line->visual_width = 0;
+    line->n_glyphs     = 0;
+
+    for (idx = 0; idx < len; idx += yed_get_glyph_len((yed_glyph*)(bytes + idx))) {
+        line->visual_width += yed_get_glyph_width((yed_glyph*)(bytes + idx));
+        line->n_glyphs     += 1;
+    }
+}
+
+yed_line *yed_buff_get_line(yed_buffer *buff, int row) {
+    if (buff == NULL || row < 1 || row > array_len(buff->lines)) { return NULL; }
+    return array_item(buff->lines, row - 1);
+}
+
+int yed_buff_n_lines(yed_buffer *buff) {
+    return array_len(buff->lines);
+}
+
+int yed_line_col_to_idx(yed_line *line, int col) {
+    char *bytes;
+    int   idx;
+    int   len;
+    int   c;
+    int   w;
+
+    bytes = array_data(line->glyphs);
+    len   = array_len(line->glyphs);
+    c     = 1;
+
+    for (idx = 0; idx < len; idx += yed_get_glyph_len((yed_glyph*)(bytes + idx))) {
+        w = yed_get_glyph_width((yed_glyph*)(bytes + idx));
+        if (col < c + w) { return idx; }
+        c += w;
+    }
+
+    return len;
+}
+
+int yed_line_idx_to_col(yed_line *line, int idx) {
+    char *bytes;
+    int   i;
+    int   col;
+
+    bytes = array_data(line->glyphs);
+    col   = 1;
+
+    for (i = 0; i < idx && i < array_len(line->glyphs); i += yed_get_glyph_len((yed_glyph*)(bytes + i))) {
+        col += yed_get_glyph_width((yed_glyph*)(bytes + i));
+    }
+
+    return col;
+}
+
+yed_glyph *yed_line_col_to_glyph(yed_line *line, int col) {
+    int idx;
+
+    idx = yed_line_col_to_idx(line, col);
+    if (idx >= array_len(line->glyphs)) { return &end_glyph; }
+
+    return (yed_glyph*)((char*)array_data(line->glyphs) + idx);
+}
+
+/* Buffers */
+
+yed_buffer *stub_make_buffer(const char *name) {
+    yed_buffer *buff;
+
+    buff        = calloc(1, sizeof(*buff));
+    buff->name  = strdup(name);
+    buff->lines = array_make(yed_line);
+
+    if (name[0] == '*') { buff->flags |= BUFF_SPECIAL; }
+
+    array_push(buffers, buff);
+
+    return buff;
+}
+
+void stub_buffer_append_line(yed_buffer *buff, const char *text, int len) {
+    yed_line line;
+
+    line.glyphs = array_make(char);
+    array_push_n(line.glyphs, (void*)text, len);
+    line_recompute(&line);
+    array_push(buff->lines, line);
+}
+
+static void line_insert_bytes(yed_buffer *buff, int row, int idx, const char *bytes, int len) {
+    yed_line *line;
+    int       old;
+
+    if (len <= 0) { return; }
+
+    line = yed_buff_get_line(buff, row);
+    old  = array_len(line->glyphs);
+
+    array_grow(&line->glyphs, len);
+    memmove((char*)line->glyphs.data + idx + len, (char*)line->glyphs.data + idx, old - idx);
+    memcpy((char*)line->glyphs.data + idx, bytes, len);
+    line->glyphs.used += len;
+    line_recompute(line);
+
+    fire_mod(buff, row, idx == old ? BUFF_MOD_APPEND_TO_LINE : BUFF_MOD_INSERT_INTO_LINE);
+}
+
+static void line_delete_bytes(yed_buffer *buff, int row, int idx, int len) {
+    yed_line *line;
+    int       old;
+
+    line = yed_buff_get_line(buff, row);
+    old  = array_len(line->glyphs);
+
+    if (idx + len > old) { len = old - idx; }
+    if (len <= 0)        { return; }
+
+    memmove((char*)line->glyphs.data + idx, (char*)line->glyphs.data + idx + len, old - idx - len);
+    line->glyphs.used -= len;
+    line_recompute(line);
+
+    fire_mod(buff, row, BUFF_MOD_DELETE_FROM_LINE);
+}
+
+static void buff_insert_line(yed_buffer *buff, int row) {
+    yed_line line;
+
+    line.glyphs       = array_make(char);
+    line.visual_width = 0;
+    line.n_glyphs     = 0;
+    array_insert(buff->lines, row - 1, line);
+
+    fire_mod(buff, row, BUFF_MOD_INSERT_LINE);
+}
+
+void yed_buff_delete_line(yed_buffer *buff, int row) {
+    yed_line *line;
+
+    if ((line = yed_buff_get_line(buff, row)) == NULL) { return; }
+
+    array_free(line->glyphs);
+    array_delete(buff->lines, row - 1);
+
+    fire_mod(buff, row, BUFF_MOD_DELETE_LINE);
+
+    if (array_len(buff->lines) == 0) {
+        buff_insert_line(buff, 1);
+    }
+}
+
+void yed_buff_clear_no_undo(yed_buffer *buff) {
+    yed_line *line;
+
+    array_traverse(buff->lines, line) {
+        array_free(line->glyphs);
+    }
+    array_clear(buff->lines);
+    stub_buffer_append_line(buff, "", 0);
+
+    fire_mod(buff, 1, BUFF_MOD_CLEAR);
+}
+
+void yed_delete_from_line(yed_buffer *buff, int row, int col) {
+    yed_line *line;
+    int       idx;
+
+    if ((line = yed_buff_get_line(buff, row)) == NULL) { return; }
+
+    idx = yed_line_col_to_idx(line, col);
+    if (idx >= array_len(line->glyphs)) { return; }
+
+    line_delete_bytes(buff, row, idx, yed_get_glyph_len(yed_line_col_to_glyph(line, col)));
+}
+
+void yed_buff_clear_line(yed_buffer *buff, int row) {
+    yed_line *line;
+
+    if ((line = yed_buff_get_line(buff, row)) == NULL) { return; }
+
+    array_clear(line->glyphs);
+    line_recompute(line);
+
+    fire_mod(buff, row, BUFF_MOD_CLEAR_LINE);
+}
+
+/* Split row at byte idx; the tail becomes row + 1. */
+static void split_line(yed_buffer *buff, int row, int idx) {
+    yed_line *line;
+    char     *tail;
+    int       len;
+
+    line = yed_buff_get_line(buff, row);
+    len  = array_len(line->glyphs) - idx;
+    tail = NULL;
+
+    if (len > 0) {
+        tail = malloc(len);
+        memcpy(tail, (char*)array_data(line->glyphs) + idx, len);
+        line_delete_bytes(buff, row, idx, len);
+    }
+
+    buff_insert_line(buff, row + 1);
+
+    if (len > 0) {
+        line_insert_bytes(buff, row + 1, 0, tail, len);
+        free(tail);
+    }
+}
+
+int yed_buff_insert_string_no_undo(yed_buffer *buff, const char *str, int row, int col) {
+    yed_line   *line;
+    int         idx;
+    const char *nl;
+
+    if ((line = yed_buff_get_line(buff, row)) == NULL) { return 1; }
+
+    idx = yed_line_col_to_idx(line, col);
+
+    for (;;) {
+        nl = strchr(str, '\n');
+        line_insert_bytes(buff, row, idx, str, nl ? (int)(nl - str) : (int)strlen(str));
+        if (nl == NULL) { break; }
+
+        split_line(buff, row, idx + (int)(nl - str));
+        row += 1;
+        idx  = 0;
+        str  = nl + 1;
+    }
+
+    return 0;
+}
+
+int yed_buff_insert_string(yed_buffer *buff, const char *str, int row, int col) {
+    int r;
+
+    yed_start_undo_record(ys->active_frame, buff);
+    r = yed_buff_insert_string_no_undo(buff, str, row, col);
+    yed_end_undo_record(ys->active_frame, buff);
+
+    return r;
+}
+
+/* Delete [r1:c1, r2:c2). */
+static void delete_range(yed_buffer *buff, int r1, int c1, int r2, int c2) {
+    yed_line *l1;
+    yed_line *l2;
+    int       i1;
+    int       i2;
+    char     *tail;
+    int       len;
+    int       row;
+
+    l1 = yed_buff_get_line(buff, r1);
+    l2 = yed_buff_get_line(buff, r2);
+    if (l1 == NULL || l2 == NULL) { return; }
+
+    i1 = yed_line_col_to_idx(l1, c1);
+    i2 = yed_line_col_to_idx(l2, c2);
+
+    if (r1 == r2) {
+        line_delete_bytes(buff, r1, i1, i2 - i1);
+        return;
+    }
+
+    len  = array_len(l2->glyphs) - i2;
+    tail = malloc(len + 1);
+    memcpy(tail, (char*)array_data(l2->glyphs) + i2, len);
+
+    for (row = r2; row > r1; row -= 1) {
+        yed_buff_delete_line(buff, row);
+    }
+
+    l1 = yed_buff_get_line(buff, r1);
+    line_delete_bytes(buff, r1, i1, array_len(l1->glyphs) - i1);
+    line_insert_bytes(buff, r1, i1, tail, len);
+
+    free(tail);
+}
+
+yed_buffer *yed_get_buffer(char *name) {
+    yed_buffer **bit;
+
+    array_traverse(buffers, bit) {
+        if (strcmp((*bit)->name, name) == 0) { return *bit; }
+    }
+
+    return NULL;
+}
+
+yed_buffer *yed_get_or_create_special_rdonly_buffer(char *name) {
+    yed_buffer **bit;
+    yed_buffer  *buff;
+
+    array_traverse(buffers, bit) {
+        if (strcmp((*bit)->name, name) == 0) { return *bit; }
+    }
+
+    buff         = stub_make_buffer(name);
+    buff->flags |= BUFF_SPECIAL | BUFF_RD_ONLY;
+    stub_buffer_append_line(buff, "", 0);
+
+    return buff;
+}
+
+/* Undo: only the number of records is tracked. */
+
+int yed_get_undo_num_records(yed_buffer *buff) {
+    return buff->n_undo_records;
+}
+
+int yed_merge_undo_records(yed_buffer *buff) {
+    if (buff->n_undo_records < 2) { return 0; }
+    buff->n_undo_records -= 1;
+    return 1;
+}
+
+void yed_start_undo_record(yed_frame *f, yed_buffer *buff) {
+    if (undo_depth++ == 0) {
+        buff->n_undo_records += 1;
+    }
+}
+
+void yed_end_undo_record(yed_frame *f, yed_buffer *buff) {
+    if (undo_depth > 0) { undo_depth -= 1; }
+}
+
+int yed_undo(yed_frame *f, yed_buffer *buff) {
+    if (buff->n_undo_records == 0) { return 0; }
+    buff->n_undo_records -= 1;
+    return 1;
+}
+
+/* Cursor and selection */
+
+void yed_set_cursor_within_frame(yed_frame *f, int row, int col) {
+    yed_line  *line;
+    yed_event  event;
+
+    if (f == NULL || f->buffer == NULL) { return; }
+
+    if (row < 1)                            { row = 1;                            }
+    if (row > yed_buff_n_lines(f->buffer))  { row = yed_buff_n_lines(f->buffer);  }
+
+    line = yed_buff_get_line(f->buffer, row);
+
+    if (col < 1)                            { col = 1;                            }
+    if (col > line->visual_width + 1)       { col = line->visual_width + 1;       }
+    col = yed_line_idx_to_col(line, yed_line_col_to_idx(line, col));
+
+    f->cursor_line = row;
+    f->cursor_col  = col;
+
+    if (row <= f->buffer_y_offset)               { f->buffer_y_offset = row - 1;             }
+    if (row >  f->buffer_y_offset + f->height)   { f->buffer_y_offset = row - f->height;     }
+
+    if (f->buffer->has_selection && !f->buffer->selection.locked) {
+        f->buffer->selection.cursor_row = row;
+        f->buffer->selection.cursor_col = col;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.kind   = EVENT_CURSOR_POST_MOVE;
+    event.frame  = f;
+    event.buffer = f->buffer;
+    fire(&event);
+}
+
+static void start_selection(int kind) {
+    yed_buffer *buff;
+
+    buff = frame.buffer;
+
+    buff->has_selection        = 1;
+    buff->selection.kind       = kind;
+    buff->selection.locked     = 0;
+    buff->selection.anchor_row = buff->selection.cursor_row = frame.cursor_line;
+    buff->selection.anchor_col = buff->selection.cursor_col = frame.cursor_col;
+}
+
+/* Normalized bounds; line selections cover whole lines. */
+static void selection_bounds(yed_buffer *buff, int *r1, int *c1, int *r2, int *c2) {
+    yed_range *s;
+    yed_line  *line;
+
+    s = &buff->selection;
+
+    if (s->anchor_row < s->cursor_row
+    ||  (s->anchor_row == s->cursor_row && s->anchor_col <= s->cursor_col)) {
+        *r1 = s->anchor_row; *c1 = s->anchor_col;
+        *r2 = s->cursor_row; *c2 = s->cursor_col;
+    } else {
+        *r1 = s->cursor_row; *c1 = s->cursor_col;
+        *r2 = s->anchor_row; *c2 = s->anchor_col;
+    }
+
+    if (s->kind == RANGE_LINE) {
+        line = yed_buff_get_line(buff, *r2);
+        *c1  = 1;
+        *c2  = line->visual_width + 1;
+    }
+}
+
+static void yank_selection(yed_buffer *buff) {
+    int       r1, c1, r2, c2;
+    int       row;
+    int       from;
+    int       to;
+    yed_line *line;
+
+    selection_bounds(buff, &r1, &c1, &r2, &c2);
+
+    array_traverse(yank->lines, line) {
+        array_free(line->glyphs);
+    }
+    array_clear(yank->lines);
+
+    if (buff->selection.kind == RANGE_LINE) {
+        yank->flags |= BUFF_YANK_LINES;
+    } else {
+        yank->flags &= ~BUFF_YANK_LINES;
+    }
+
+    for (row = r1; row <= r2; row += 1) {
+        line = yed_buff_get_line(buff, row);
+        from = row == r1 ? yed_line_col_to_idx(line, c1) : 0;
+        to   = row == r2 ? yed_line_col_to_idx(line, c2) : array_len(line->glyphs);
+        stub_buffer_append_line(yank, (char*)array_data(line->glyphs) + from, to - from);
+    }
+}
+
+static void delete_selection(yed_buffer *buff) {
+    int r1, c1, r2, c2;
+    int row;
+
+    selection_bounds(buff, &r1, &c1, &r2, &c2);
+
+    buff->has_selection = 0;
+
+    yed_start_undo_record(&frame, buff);
+    if (buff->selection.kind == RANGE_LINE) {
+        for (row = r2; row >= r1; row -= 1) {
+            yed_buff_delete_line(buff, row);
+        }
+        c1 = 1;
+    } else {
+        delete_range(buff, r1, c1, r2, c2);
+    }
+    yed_end_undo_record(&frame, buff);
+
+    yed_set_cursor_within_frame(&frame, r1, c1);
+}
+
+/* Built-in commands */
+
+static int has_buffer(void) {
+    return frame.buffer != NULL;
+}
+
+static void cmd_select(int n_args, char **args) {
+    if (has_buffer()) { start_selection(RANGE_NORMAL); }
+}
+
+static void cmd_select_lines(int n_args, char **args) {
+    if (has_buffer()) { start_selection(RANGE_LINE); }
+}
+
+static void cmd_select_rect(int n_args, char **args) {
+    if (has_buffer()) { start_selection(RANGE_RECT); }
+}
+
+static void cmd_select_off(int n_args, char **args) {
+    if (has_buffer()) { frame.buffer->has_selection = 0; }
+}
+
+static void move_by(int drow, int dcol) {
+    yed_line *line;
+    int       row;
+    int       col;
+
+    if (!has_buffer()) { return; }
+
+    row = frame.cursor_line + drow;
+    col = frame.cursor_col;
+
+    if (dcol > 0) {
+        line = yed_buff_get_line(frame.buffer, row);
+        if (col <= line->visual_width) {
+            col += yed_get_glyph_width(yed_line_col_to_glyph(line, col));
+        }
+    } else if (dcol < 0 && col > 1) {
+        line = yed_buff_get_line(frame.buffer, row);
+        col  = yed_line_idx_to_col(line, yed_line_col_to_idx(line, col - 1));
+    }
+
+    yed_set_cursor_within_frame(&frame, row, col);
+}
+
+static void cmd_cursor_left(int n_args, char **args)  { move_by(0, -1);                 }
+static void cmd_cursor_right(int n_args, char **args) { move_by(0, 1);                  }
+static void cmd_cursor_up(int n_args, char **args)    { move_by(-1, 0);                 }
+static void cmd_cursor_down(int n_args, char **args)  { move_by(1, 0);                  }
+static void cmd_page_up(int n_args, char **args)      { move_by(-frame.height, 0);      }
+static void cmd_page_down(int n_args, char **args)   { move_by(frame.height, 0);       }
+
+static void cmd_line_begin(int n_args, char **args) {
+    if (has_buffer()) { yed_set_cursor_within_frame(&frame, frame.cursor_line, 1); }
+}
+
+static void cmd_line_end(int n_args, char **args) {
+    if (has_buffer()) { yed_set_cursor_within_frame(&frame, frame.cursor_line, INT_MAX); }
+}
+
+static void cmd_buffer_begin(int n_args, char **args) {
+    if (has_buffer()) { yed_set_cursor_within_frame(&frame, 1, 1); }
+}
+
+static void cmd_buffer_end(int n_args, char **args) {
+    if (has_buffer()) { yed_set_cursor_within_frame(&frame, INT_MAX, 1); }
+}
+
+static void cmd_yank_selection(int n_args, char **args) {
+    if (!has_buffer() || !frame.buffer->has_selection) { return; }
+
+    yank_selection(frame.buffer);
+
+    if (n_args == 0) { frame.buffer->has_selection = 0; }
+}
+
+static void cmd_delete_back(int n_args, char **args) {
+    yed_buffer *buff;
+    yed_line   *line;
+    int         row;
+    int         col;
+
+    if (!has_buffer()) { return; }
+
+    buff = frame.buffer;
+
+    if (buff->has_selection) {
+        delete_selection(buff);
+        return;
+    }
+
+    row = frame.cursor_line;
+    col = frame.cursor_col;
+
+    if (col > 1) {
+        move_by(0, -1);
+        yed_start_undo_record(&frame, buff);
+        yed_delete_from_line(buff, row, frame.cursor_col);
+        yed_end_undo_record(&frame, buff);
+    } else if (row > 1) {
+        line = yed_buff_get_line(buff, row - 1);
+        col  = line->visual_width + 1;
+        yed_start_undo_record(&frame, buff);
+        delete_range(buff, row - 1, col, row, 1);
+        yed_end_undo_record(&frame, buff);
+        yed_set_cursor_within_frame(&frame, row - 1, col);
+    }
+}
+
+static void cmd_delete_forward(int n_args, char **args) {
+    yed_buffer *buff;
+    yed_line   *line;
+
+    if (!has_buffer()) { return; }
+
+    buff = frame.buffer;
+
+    if (buff->has_selection) {
+        delete_selection(buff);
+        return;
+    }
+
+    line = yed_buff_get_line(buff, frame.cursor_line);
+
+    yed_start_undo_record(&frame, buff);
+    if (frame.cursor_col <= line->visual_width) {
+        yed_delete_from_line(buff, frame.cursor_line, frame.cursor_col);
+    } else if (frame.cursor_line < yed_buff_n_lines(buff)) {
+        delete_range(buff, frame.cursor_line, frame.cursor_col, frame.cursor_line + 1, 1);
+    }
+    yed_end_undo_record(&frame, buff);
+}
+
+static void cmd_paste(int n_args, char **args) {
+    yed_buffer *buff;
+    yed_line   *line;
+    array_t     text;
+    int         lines;
+    char        nl;
+
+    if (!has_buffer()) { return; }
+
+    buff  = frame.buffer;
+    lines = yank->flags & BUFF_YANK_LINES;
+    text  = array_make(char);
+    nl    = '\n';
+
+    array_traverse(yank->lines, line) {
+        if (lines || line != array_data(yank->lines)) { array_push(text, nl); }
+        array_push_n(text, array_data(line->glyphs), array_len(line->glyphs));
+    }
+    array_zero_term(text);
+
+    yed_start_undo_record(&frame, buff);
+    if (lines) {
+        /* Lines go in below the cursor line. */
+        line = yed_buff_get_line(buff, frame.cursor_line);
+        yed_buff_insert_string_no_undo(buff, array_data(text), frame.cursor_line, line->visual_width + 1);
+        yed_set_cursor_within_frame(&frame, frame.cursor_line + 1, 1);
+    } else {
+        yed_buff_insert_string_no_undo(buff, array_data(text), frame.cursor_line, frame.cursor_col);
+    }
+    yed_end_undo_record(&frame, buff);
+
+    array_free(text);
+}
+
+static void cmd_nothing(int n_args, char **args) { }
+
+static void cmd_insert(int n_args, char **args) {
+    yed_buffer *buff;
+    int         key;
+    char        c;
+
+    if (!has_buffer() || n_args != 1 || sscanf(args[0], "%d", &key) != 1) { return; }
+
+    buff = frame.buffer;
+
+    yed_start_undo_record(&frame, buff);
+    if (key == ENTER) {
+        split_line(buff, frame.cursor_line, yed_line_col_to_idx(yed_buff_get_line(buff, frame.cursor_line), frame.cursor_col));
+        yed_set_cursor_within_frame(&frame, frame.cursor_line + 1, 1);
+    } else if (key == MBYTE) {
+        line_insert_bytes(buff, frame.cursor_line,
+                          yed_line_col_to_idx(yed_buff_get_line(buff, frame.cursor_line), frame.cursor_col),
+                          ys->mbyte.bytes, yed_get_glyph_len(&ys->mbyte));
+        move_by(0, 1);
+    } else if (key < 128) {
+        c = key;
+        line_insert_bytes(buff, frame.cursor_line,
+                          yed_line_col_to_idx(yed_buff_get_line(buff, frame.cursor_line), frame.cursor_col),
+                          &c, 1);
+        move_by(0, 1);
+    }
+    yed_end_undo_record(&frame, buff);
+}
+
+static void find(int dir) {
+    yed_buffer *buff;
+    yed_line   *line;
+    int         n;
+    int         row;
+    int         i;
+    int         start;
+    int         len;
+    int         s_len;
+    char       *bytes;
+
+    if (!has_buffer() || ys->current_search == NULL || (s_len = strlen(ys->current_search)) == 0) { return; }
+
+    buff = frame.buffer;
+    n    = yed_buff_n_lines(buff);
+    row  = frame.cursor_line;
+    line = yed_buff_get_line(buff, row);
+
+    start = yed_line_col_to_idx(line, frame.cursor_col) + dir;
+
+    for (i = 0; i <= n; i += 1) {
+        line  = yed_buff_get_line(buff, row);
+        bytes = array_data(line->glyphs);
+        len   = array_len(line->glyphs);
+
+        if (dir > 0) {
+            for (; start + s_len <= len; start += 1) {
+                if (memcmp(bytes + start, ys->current_search, s_len) == 0) { goto found; }
+            }
+            row   = row == n ? 1 : row + 1;
+            start = 0;
+        } else {
+            if (start > len - s_len) { start = len - s_len; }
+            for (; start >= 0; start -= 1) {
+                if (memcmp(bytes + start, ys->current_search, s_len) == 0) { goto found; }
+            }
+            row   = row == 1 ? n : row - 1;
+            start = INT_MAX;
+        }
+    }
+    return;
+
+found:;
+    yed_set_cursor_within_frame(&frame, row, yed_line_idx_to_col(line, start));
+}
+
+static void cmd_find_next(int n_args, char **args) { find(1);  }
+static void cmd_find_prev(int n_args, char **args) { find(-1); }
+
+static void cmd_buffer(int n_args, char **args) {
+    yed_buffer **bit;
+
+    if (n_args != 1) { return; }
+
+    array_traverse(buffers, bit) {
+        if (strcmp((*bit)->name, args[0]) == 0) {
+            frame.buffer = *bit;
+            yed_set_cursor_within_frame(&frame, 1, 1);
+            return;
+        }
+    }
+}
+
+static void add_command(char *name, yed_command fn) {
+    command_entry *cit;
+    command_entry  c;
+
+    array_traverse(commands, cit) {
+        if (strcmp(cit->name, name) == 0) {
+            cit->fn = fn;
+            return;
+        }
+    }
+
+    c.name = strdup(name);
+    c.fn   = fn;
+    array_push(commands, c);
+}
+
+/* Commands, bindings, sequences */
+
+void yed_plugin_set_command(yed_plugin *plug, char *name, yed_command fn) {
+    add_command(name, fn);
+}
+
+yed_command yed_get_command(char *name) {
+    command_entry *cit;
+
+    array_traverse(commands, cit) {
+        if (strcmp(cit->name, name) == 0) { return cit->fn; }
+    }
+
+    return NULL;
+}
+
+int yed_execute_command(char *name, int n_args, char **args) {
+    yed_command fn;
+
+    if ((fn = yed_get_command(name)) == NULL) {
+        yed_cerr("unknown command '%s'", name);
+        return 1;
+    }
+
+    fn(n_args, args);
+
+    return 0;
+}
+
+void yed_plugin_set_unload_fn(yed_plugin *plug, void (*fn)(yed_plugin*)) {
+    unload_fn = fn;
+}
+
+void yed_plugin_add_event_handler(yed_plugin *plug, yed_event_handler handler) {
+    array_push(handlers[handler.kind], handler);
+}
+
+void yed_plugin_set_completion(yed_plugin *plug, char *name, yed_completion fn) { }
+
+yed_completion yed_get_completion(char *name) {
+    return NULL;
+}
+
+void yed_unbind_key(int key) {
+    yed_key_binding *b;
+    int              i;
+
+    if (key <= 0 || key >= VIRT_KEY_MAX || (b = bindings[key]) == NULL) { return; }
+
+    for (i = 0; i < b->n_args; i += 1) { free(b->args[i]); }
+    free(b->args);
+    free(b->cmd);
+    free(b);
+
+    bindings[key] = NULL;
+}
+
+void yed_plugin_bind_key(yed_plugin *plug, int key, char *cmd, int n_args, char **args) {
+    yed_key_binding *b;
+    int              i;
+
+    if (key <= 0 || key >= VIRT_KEY_MAX) { return; }
+
+    yed_unbind_key(key);
+
+    b         = malloc(sizeof(*b));
+    b->key    = key;
+    b->cmd    = strdup(cmd);
+    b->n_args = n_args;
+    b->args   = n_args ? malloc(n_args * sizeof(char*)) : NULL;
+    for (i = 0; i < n_args; i += 1) { b->args[i] = strdup(args[i]); }
+
+    bindings[key] = b;
+}
+
+yed_key_binding *yed_get_key_binding(int key) {
+    if (key <= 0 || key >= VIRT_KEY_MAX) { return NULL; }
+    return bindings[key];
+}
+
+int yed_get_key_sequence(int len, int *keys) {
+    key_sequence *sit;
+
+    array_traverse(sequences, sit) {
+        if (sit->len == len && memcmp(sit->keys, keys, len * sizeof(int)) == 0) {
+            return sit->key;
+        }
+    }
+
+    return KEY_NULL;
+}
+
+int yed_plugin_add_key_sequence(yed_plugin *plug, int len, int *keys) {
+    key_sequence  seq;
+    key_sequence *sit;
+    int           key;
+
+    if (len < 2 || len > MAX_SEQ_LEN)                   { return KEY_NULL; }
+    if ((key = yed_get_key_sequence(len, keys)) != 0)   { return key;      }
+
+    /* Lowest free virtual key. */
+    for (key = VIRT_KEY_START; key < VIRT_KEY_MAX; key += 1) {
+        array_traverse(sequences, sit) {
+            if (sit->key == key) { break; }
+        }
+        if ((char*)sit == (char*)array_data(sequences) + (array_len(sequences) * sequences.elem_size)) {
+            break;
+        }
+    }
+    if (key == VIRT_KEY_MAX) { return KEY_NULL; }
+
+    seq.len = len;
+    seq.key = key;
+    memcpy(seq.keys, keys, len * sizeof(int));
+    array_push(sequences, seq);
+
+    return key;
+}
+
+int yed_delete_key_sequence(int key) {
+    key_sequence *sit;
+    int           i;
+
+    i = 0;
+    array_traverse(sequences, sit) {
+        if (sit->key == key) {
+            array_delete(sequences, i);
+            return 0;
+        }
+        i += 1;
+    }
+
+    return 1;
+}
+
+/* "a", "ctrl-x", "esc", "enter", "tab", "spc", "bsp", separated by spaces. */
+int yed_string_to_keys(const char *str, int *keys) {
+    char tok[32];
+    int  n;
+    int  len;
+
+    n = 0;
+
+    while (*str) {
+        while (*str == ' ') { str += 1; }
+        if (!*str) { break; }
+
+        for (len = 0; str[len] && str[len] != ' '; len += 1) { }
+        if (len >= (int)sizeof(tok)) { return -1; }
+        memcpy(tok, str, len);
+        tok[len] = 0;
+        str     += len;
+
+        if (n == MAX_SEQ_LEN) { return -2; }
+
+        if (len == 1) {
+            keys[n] = tok[0];
+        } else if (len == 6 && memcmp(tok, "ctrl-", 5) == 0 && islower(tok[5])) {
+            keys[n] = tok[5] - 'a' + 1;
+        } else if (strcmp(tok, "esc")   == 0) { keys[n] = ESC;       }
+        else if   (strcmp(tok, "enter") == 0) { keys[n] = ENTER;     }
+        else if   (strcmp(tok, "tab")   == 0) { keys[n] = TAB;       }
+        else if   (strcmp(tok, "spc")   == 0) { keys[n] = ' ';       }
+        else if   (strcmp(tok, "bsp")   == 0) { keys[n] = BACKSPACE; }
+        else                                  { return -1;           }
+
+        n += 1;
+    }
+
+    return n == 0 ? -1 : n;
+}
+
+/* Variables and messages */
+
+char *yed_get_var(const char *name) {
+    var_entry *vit;
+
+    array_traverse(vars, vit) {
+        if (strcmp(vit->name, name) == 0) { return vit->val; }
+    }
+
+    return NULL;
+}
+
+void yed_set_var(const char *name, const char *val) {
+    var_entry *vit;
+    var_entry  v;
+
+    array_traverse(vars, vit) {
+        if (strcmp(vit->name, name) == 0) {
+            if (strcmp(vit->val, val) != 0) {
+                free(vit->val);
+                vit->val = strdup(val);
+            }
+            return;
+        }
+    }
+
+    v.name = strdup(name);
+    v.val  = strdup(val);
+    array_push(vars, v);
+}
+
+void yed_unset_var(const char *name) {
+    var_entry *vit;
+    int        i;
+
+    i = 0;
+    array_traverse(vars, vit) {
+        if (strcmp(vit->name, name) == 0) {
+            free(vit->name);
+            free(vit->val);
+            array_delete(vars, i);
+            return;
+        }
+        i += 1;
+    }
+}
+
+void yed_cerr(const char *fmt, ...) {
+    va_list va;
+
+    n_errors += 1;
+
+    if (getenv("XUL_BENCH_VERBOSE")) {
+        va_start(va, fmt);
+        fprintf(stderr, "error: ");
+        vfprintf(stderr, fmt, va);
+        fprintf(stderr, "\n");
+        va_end(va);
+    }
+}
+
+void yed_cprint(const char *fmt, ...) {
+    va_list va;
+
+    va_start(va, fmt);
+    vfprintf(stderr, fmt, va);
+    fprintf(stderr, "\n");
+    va_end(va);
+}
+
+void yed_log(const char *fmt, ...) { }
+
+void yed_set_update_hz(int hz) { ys->update_hz = hz; }
+
+void append_to_output_buff(char *s) { }
+void flush_output_buff(void)        { }
+
+/* Styles */
+
+yed_attrs yed_active_style_get_selection(void) {
+    yed_attrs a;
+
+    a.fg    = 0;
+    a.bg    = 4;
+    a.flags = 1;
+
+    return a;
+}
+
+void yed_combine_attrs(yed_attrs *dst, yed_attrs *src) {
+    if (src->fg) { dst->fg = src->fg; }
+    if (src->bg) { dst->bg = src->bg; }
+    dst->flags |= src->flags;
+}
+
+/* Driving */
+
+void stub_boot(void) {
+    int i;
+
+    buffers   = array_make(yed_buffer*);
+    commands  = array_make(command_entry);
+    sequences = array_make(key_sequence);
+    vars      = array_make(var_entry);
+    yank      = yed_get_or_create_special_rdonly_buffer("*yank");
+
+    for (i = 0; i < N_EVENTS; i += 1) {
+        handlers[i] = array_make(yed_event_handler);
+    }
+
+    add_command("select",                       cmd_select);
+    add_command("select-lines",                 cmd_select_lines);
+    add_command("select-rect",                  cmd_select_rect);
+    add_command("select-off",                   cmd_select_off);
+    add_command("cursor-left",                  cmd_cursor_left);
+    add_command("cursor-right",                 cmd_cursor_right);
+    add_command("cursor-up",                    cmd_cursor_up);
+    add_command("cursor-down",                  cmd_cursor_down);
+    add_command("cursor-page-up",               cmd_page_up);
+    add_command("cursor-page-down",             cmd_page_down);
+    add_command("cursor-line-begin",            cmd_line_begin);
+    add_command("cursor-line-end",              cmd_line_end);
+    add_command("cursor-buffer-begin",          cmd_buffer_begin);
+    add_command("cursor-buffer-end",            cmd_buffer_end);
+    add_command("find-next-in-buffer",          cmd_find_next);
+    add_command("find-prev-in-buffer",          cmd_find_prev);
+    add_command("yank-selection",               cmd_yank_selection);
+    add_command("delete-back",                  cmd_delete_back);
+    add_command("delete-forward",               cmd_delete_forward);
+    add_command("paste-yank-buffer",            cmd_paste);
+    add_command("undo",                         cmd_nothing);
+    add_command("redo",                         cmd_nothing);
+    add_command("insert",                       cmd_insert);
+    add_command("find-in-buffer",               cmd_nothing);
+    add_command("replace-current-search",       cmd_nothing);
+    add_command("command-prompt",               cmd_nothing);
+    add_command("special-buffer-prepare-focus", cmd_nothing);
+    add_command("buffer",                       cmd_buffer);
+
+    frame.height      = FRAME_HEIGHT;
+    frame.width       = FRAME_WIDTH;
+    frame.cursor_line = 1;
+    frame.cursor_col  = 1;
+
+    ys->active_frame = &frame;
+    ys->frames       = array_make(yed_frame*);
+
+    yed_plugin_boot(NULL);
+}
+
+void stub_unload(void) {
+    if (unload_fn) { unload_fn(NULL); }
+}
+
+/* Show a buffer in the frame, as if it had just been loaded. */
+void stub_open(yed_buffer *buff) {
+    yed_event event;
+
+    if (array_len(buff->lines) == 0) {
+        stub_buffer_append_line(buff, "", 0);
+    }
+
+    frame.buffer          = buff;
+    frame.buffer_y_offset = 0;
+
+    memset(&event, 0, sizeof(event));
+    event.kind   = EVENT_BUFFER_POST_LOAD;
+    event.frame  = &frame;
+    event.buffer = buff;
+    fire(&event);
+
+    yed_set_cursor_within_frame(&frame, 1, 1);
+}
+
+/* One pass of the event loop with no input. */
+void stub_pump(void) {
+    yed_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.kind  = EVENT_PRE_PUMP;
+    event.frame = ys->active_frame;
+    fire(&event);
+
+    stub_draw();
+}
+
+/* What the core does for one key: a pump, the pre-press handlers, then its binding. */
+void stub_press_key(int key) {
+    yed_event        event;
+    yed_key_binding *b;
+
+    memset(&event, 0, sizeof(event));
+    event.kind  = EVENT_PRE_PUMP;
+    event.frame = ys->active_frame;
+    fire(&event);
+
+    memset(&event, 0, sizeof(event));
+    event.kind  = EVENT_KEY_PRE_PRESS;
+    event.frame = ys->active_frame;
+    event.key   = key;
+    fire(&event);
+
+    if (!event.cancel && (b = yed_get_key_binding(key)) != NULL) {
+        yed_execute_command(b->cmd, b->n_args, b->args);
+    }
+}
+
+/* One screen update: the draw events for every visible line. */
+void stub_draw(void) {
+    static array_t  attrs;
+    yed_event       event;
+    yed_attrs       blank;
+    int             row;
+    int             i;
+
+    if (array_len(attrs) == 0) {
+        attrs = array_make(yed_attrs);
+        memset(&blank, 0, sizeof(blank));
+        for (i = 0; i < FRAME_WIDTH; i += 1) { array_push(attrs, blank); }
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.kind  = EVENT_PRE_DRAW_EVERYTHING;
+    event.frame = &frame;
+    fire(&event);
+
+    if (frame.buffer == NULL) { return; }
+
+    for (row = frame.buffer_y_offset + 1;
+         row <= frame.buffer_y_offset + frame.height && row <= yed_buff_n_lines(frame.buffer);
+         row += 1) {
+
+        memset(array_data(attrs), 0, array_len(attrs) * sizeof(yed_attrs));
+
+        memset(&event, 0, sizeof(event));
+        event.kind       = EVENT_LINE_PRE_DRAW;
+        event.frame      = &frame;
+        event.buffer     = frame.buffer;
+        event.row        = row;
+        event.line_attrs = attrs;
+        fire(&event);
+    }
+
+    ys->redraw = 0;
+}
+
+int stub_n_errors(void) {
+    return n_errors;
+}
@@ -0,0 +1,304 @@
+/*
+ * A small stand-in for yed's plugin API: just enough of it to build
+ * xul.c into a headless benchmark (see bench.c).  Buffers, cursors,
+ * selections, commands, key bindings, variables, and events behave
+ * like yed's for the parts xul uses.  Nothing is drawn.
+ */
+#ifndef XUL_BENCH_YED_PLUGIN_H
+#define XUL_BENCH_YED_PLUGIN_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <limits.h>
+
+/* Arrays */
+typedef struct {
+    void *data;
+    int   elem_size;
+    int   used;
+    int   capacity;
+} array_t;
+
+array_t  _array_make(int elem_size);
+void    *_array_push(array_t *a, void *elem);
+void    *_array_insert(array_t *a, int idx, void *elem);
+void     _array_delete(array_t *a, int idx);
+void     _array_push_n(array_t *a, void *elems, int n);
+void     _array_zero_term(array_t *a);
+
+#define array_make(T)         _array_make(sizeof(T))
+#define array_len(a)          ((a).used)
+#define array_data(a)         ((a).data)
+#define array_item(a, i)      ((void*)(((char*)(a).data) + ((i) * (a).elem_size)))
+#define array_last(a)         (array_len(a) ? array_item(a, array_len(a) - 1) : NULL)
+#define array_push(a, e)      (_array_push(&(a), &(e)))
+#define array_push_n(a, e, n) (_array_push_n(&(a), (e), (n)))
+#define array_insert(a, i, e) (_array_insert(&(a), (i), &(e)))
+#define array_delete(a, i)    (_array_delete(&(a), (i)))
+#define array_pop(a)          ((a).used ? (a).used -= 1 : 0)
+#define array_clear(a)        ((a).used = 0)
+#define array_free(a)         (free((a).data), (a).data = NULL, (a).used = (a).capacity = 0)
+#define array_zero_term(a)    (_array_zero_term(&(a)))
+#define array_traverse(a, it) \
+    for ((it) = (a).data; (char*)(it) < ((char*)(a).data) + ((a).used * (a).elem_size); (it) += 1)
+
+/* Keys */
+#define MAX_SEQ_LEN (8)
+
+enum {
+    KEY_NULL  = 0,
+    CTRL_A    = 1,
+    CTRL_C    = 3,
+    CTRL_D    = 4,
+    CTRL_F    = 6,
+    CTRL_H    = 8,
+    TAB       = 9,
+    ENTER     = 13,
+    CTRL_R    = 18,
+    CTRL_V    = 22,
+    CTRL_W    = 23,
+    ESC       = 27,
+    BACKSPACE = 127,
+
+    ARROW_LEFT = 1000,
+    ARROW_RIGHT,
+    ARROW_UP,
+    ARROW_DOWN,
+    DEL_KEY,
+    HOME_KEY,
+    END_KEY,
+    PAGE_UP,
+    PAGE_DOWN,
+    SHIFT_TAB,
+    MENU_KEY,
+    MBYTE,
+    REAL_KEY_MAX,
+
+    VIRT_KEY_START = 2048,
+    VIRT_KEY_MAX   = 4096,
+};
+
+/* Text */
+typedef union {
+    char          c;
+    unsigned char u_c;
+    uint32_t      data;
+    char          bytes[4];
+} yed_glyph;
+
+int yed_get_glyph_len(yed_glyph *g);
+int yed_get_glyph_width(yed_glyph *g);
+
+typedef struct {
+    array_t glyphs; /* UTF-8 bytes */
+    int     visual_width;
+    int     n_glyphs;
+} yed_line;
+
+enum {
+    RANGE_NORMAL,
+    RANGE_LINE,
+    RANGE_RECT,
+};
+
+typedef struct {
+    int kind;
+    int locked;
+    int anchor_row, anchor_col;
+    int cursor_row, cursor_col;
+} yed_range;
+
+#define BUFF_MODIFIED   (0x1)
+#define BUFF_RD_ONLY    (0x2)
+#define BUFF_SPECIAL    (0x4)
+#define BUFF_YANK_LINES (0x8)
+
+typedef struct yed_buffer_t {
+    int        kind;
+    int        flags;
+    char      *name;
+    char      *path;
+    array_t    lines; /* yed_line */
+    int        has_selection;
+    yed_range  selection;
+    int        n_undo_records;
+} yed_buffer;
+
+typedef struct yed_frame_t {
+    yed_buffer *buffer;
+    int         top, left, height, width;
+    int         cursor_line, cursor_col;
+    int         buffer_y_offset, buffer_x_offset;
+    int         cur_y, cur_x;
+} yed_frame;
+
+typedef void (*yed_command)(int n_args, char **args);
+
+typedef struct {
+    int    key;
+    char  *cmd;
+    int    n_args;
+    char **args;
+} yed_key_binding;
+
+typedef struct {
+    yed_frame *active_frame;
+    array_t    frames;
+    char      *current_search;
+    int        interactive_command;
+    yed_glyph  mbyte;
+    int        redraw;
+    int        update_hz; /* 0 = only on input */
+} yed_state;
+
+extern yed_state *ys;
+
+typedef struct yed_plugin_t yed_plugin;
+
+typedef struct {
+    int fg, bg, flags;
+} yed_attrs;
+
+/* Events */
+enum {
+    EVENT_LINE_PRE_DRAW,
+    EVENT_PRE_DRAW_EVERYTHING,
+    EVENT_KEY_PRE_PRESS,
+    EVENT_BUFFER_PRE_FOCUS,
+    EVENT_BUFFER_POST_MOD,
+    EVENT_BUFFER_POST_LOAD,
+    EVENT_BUFFER_PRE_DELETE,
+    EVENT_CURSOR_POST_MOVE,
+    EVENT_PRE_PUMP,
+    EVENT_PLUGIN_POST_LOAD,
+    EVENT_PLUGIN_POST_UNLOAD,
+    N_EVENTS,
+};
+
+enum {
+    BUFF_MOD_APPEND_TO_LINE,
+    BUFF_MOD_POP_FROM_LINE,
+    BUFF_MOD_INSERT_INTO_LINE,
+    BUFF_MOD_DELETE_FROM_LINE,
+    BUFF_MOD_ADD_LINE,
+    BUFF_MOD_SET_LINE,
+    BUFF_MOD_INSERT_LINE,
+    BUFF_MOD_DELETE_LINE,
+    BUFF_MOD_CLEAR,
+    BUFF_MOD_CLEAR_LINE,
+    N_BUFF_MOD_EVENTS,
+};
+
+typedef struct {
+    int         kind;
+    yed_frame  *frame;
+    yed_buffer *buffer;
+    int         row, col;
+    int         key;
+    int         buff_mod_event;
+    array_t     line_attrs; /* yed_attrs, one per column */
+    int         cancel;
+} yed_event;
+
+typedef struct {
+    int   kind;
+    void (*fn)(yed_event*);
+} yed_event_handler;
+
+/* Completion (not used headless) */
+typedef struct {
+    array_t strings;
+} yed_completion_results;
+
+typedef int (*yed_completion)(char*, yed_completion_results*);
+
+#define FN_BODY_FOR_COMPLETE_FROM_ARRAY(_str, _n, _arr, _results, _status) \
+    do { (void)(_str); (void)(_n); (void)(_arr); (void)(_results); (_status) = 0; } while (0)
+
+#define YED_PLUG_VERSION_CHECK() do { } while (0)
+#define LOG_FN_ENTER()           do { } while (0)
+#define LOG_EXIT()               do { } while (0)
+
+#define YEXE(_cmd_name, ...)                                                          \
+    do {                                                                              \
+        char *__YEXE_args[] = { __VA_ARGS__ };                                        \
+        yed_execute_command((_cmd_name), sizeof(__YEXE_args) / sizeof(char*), __YEXE_args); \
+    } while (0)
+
+#define YPBIND(_p, _k, _c, ...)                                                              \
+    do {                                                                                     \
+        char *__YPBIND_args[] = { __VA_ARGS__ };                                             \
+        yed_plugin_bind_key((_p), (_k), (_c), sizeof(__YPBIND_args) / sizeof(char*), __YPBIND_args); \
+    } while (0)
+
+/* Plugins, commands, keys */
+void             yed_plugin_set_unload_fn(yed_plugin *plug, void (*fn)(yed_plugin*));
+void             yed_plugin_add_event_handler(yed_plugin *plug, yed_event_handler handler);
+void             yed_plugin_set_command(yed_plugin *plug, char *name, yed_command fn);
+void             yed_plugin_set_completion(yed_plugin *plug, char *name, yed_completion fn);
+yed_completion   yed_get_completion(char *name);
+yed_command      yed_get_command(char *name);
+int              yed_execute_command(char *name, int n_args, char **args);
+void             yed_plugin_bind_key(yed_plugin *plug, int key, char *cmd, int n_args, char **args);
+void             yed_unbind_key(int key);
+yed_key_binding *yed_get_key_binding(int key);
+int              yed_plugin_add_key_sequence(yed_plugin *plug, int len, int *keys);
+int              yed_get_key_sequence(int len, int *keys);
+int              yed_delete_key_sequence(int key);
+int              yed_string_to_keys(const char *str, int *keys);
+
+/* Variables and messages */
+char *yed_get_var(const char *name);
+void  yed_set_var(const char *name, const char *val);
+void  yed_unset_var(const char *name);
+void  yed_cerr(const char *fmt, ...);
+void  yed_cprint(const char *fmt, ...);
+void  yed_log(const char *fmt, ...);
+void  yed_set_update_hz(int hz);
+
+/* Terminal output (discarded) */
+void append_to_output_buff(char *s);
+void flush_output_buff(void);
+
+/* Buffers, lines, cursor */
+yed_line   *yed_buff_get_line(yed_buffer *buff, int row);
+int         yed_buff_n_lines(yed_buffer *buff);
+yed_glyph  *yed_line_col_to_glyph(yed_line *line, int col);
+int         yed_line_col_to_idx(yed_line *line, int col);
+int         yed_line_idx_to_col(yed_line *line, int idx);
+void        yed_set_cursor_within_frame(yed_frame *frame, int row, int col);
+int         yed_buff_insert_string(yed_buffer *buff, const char *str, int row, int col);
+int         yed_buff_insert_string_no_undo(yed_buffer *buff, const char *str, int row, int col);
+void        yed_buff_clear_no_undo(yed_buffer *buff);
+void        yed_buff_delete_line(yed_buffer *buff, int row);
+void        yed_delete_from_line(yed_buffer *buff, int row, int col);
+void        yed_buff_clear_line(yed_buffer *buff, int row);
+yed_buffer *yed_get_or_create_special_rdonly_buffer(char *name);
+yed_buffer *yed_get_buffer(char *name);
+
+/* Undo (only the record count is kept) */
+int  yed_get_undo_num_records(yed_buffer *buff);
+int  yed_merge_undo_records(yed_buffer *buff);
+void yed_start_undo_record(yed_frame *frame, yed_buffer *buff);
+void yed_end_undo_record(yed_frame *frame, yed_buffer *buff);
+int  yed_undo(yed_frame *frame, yed_buffer *buff);
+
+/* Styles */
+yed_attrs yed_active_style_get_selection(void);
+void      yed_combine_attrs(yed_attrs *dst, yed_attrs *src);
+
+/* Bench-only hooks, implemented in yed.c */
+yed_buffer *stub_make_buffer(const char *name);
+void        stub_buffer_append_line(yed_buffer *buff, const char *text, int len);
+void        stub_open(yed_buffer *buff);
+void        stub_press_key(int key);
+void        stub_pump(void);
+void        stub_draw(void);
+void        stub_boot(void);
+void        stub_unload(void);
+int         stub_n_errors(void);
+
+#endif
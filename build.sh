@@ -1,2 +1,10 @@
 #!/usr/bin/env bash
-gcc -o xul.so xul.c $(yed --print-cflags --print-ldflags)
+
+# ./build.sh bench [args]: build xul against the headless API in bench/ and run it.
+if [ "$1" = "bench" ]; then
+    shift
+    gcc -O2 -DXUL_BENCH -o bench/xul-bench -Ibench bench/bench.c bench/yed.c xul.c -lpthread || exit 1
+    exec bench/xul-bench "$@"
+fi
+
+gcc -o xul.so xul.c $(yed --print-cflags --print-ldflags) -lpthread
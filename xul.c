@@ -1,10 +1,32 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* memrchr() */
+#endif
+
 #include <yed/plugin.h>
 
+#include <errno.h>
+#include <time.h>
+#include <regex.h>
+#include <pthread.h>
+#include <unistd.h>
+
 /* COMMANDS */
 void xul_take_key(int n_args, char **args);
 void xul_bind(int n_args, char **args);
 void xul_unbind(int n_args, char **args);
 void xul_exit_insert(int n_args, char **args);
+void xul_paste_begin(int n_args, char **args);
+void xul_paste_end(int n_args, char **args);
+#ifdef XUL_BENCH
+void xul_bench_dispatch(int n_args, char **args);
+#endif
+void xul_select_matches(int n_args, char **args);
+void xul_select_regex(int n_args, char **args);
+void xul_split_regex(int n_args, char **args);
+void xul_keep_regex(int n_args, char **args);
+void xul_drop_regex(int n_args, char **args);
+void xul_stats(int n_args, char **args);
+void xul_trace(int n_args, char **args);
 /* END COMMANDS */
 
 enum {
@@ -23,6 +45,90 @@ static char *mode_strs_lowercase[] = {
     "insert",
 };
 
+/*
+ * Built-in commands that xul runs on every key.  The cursor and
+ * selection commands are looked up once (and again whenever a plugin
+ * is loaded or unloaded) and called through cmd_fns[] instead of
+ * going through yed_execute_command() by name.  That skips anything
+ * the core does around a command run by name, so commands that edit
+ * or search, which other plugins are more likely to watch, are still
+ * run by name.  Interactive commands (prompts, searches) go through
+ * YEXE_COUNTED().
+ */
+enum {
+    CMD_SELECT_OFF,
+    CMD_SELECT,
+    CMD_SELECT_LINES,
+    CMD_SELECT_RECT,
+    CMD_CURSOR_LEFT,
+    CMD_CURSOR_RIGHT,
+    CMD_CURSOR_UP,
+    CMD_CURSOR_DOWN,
+    CMD_CURSOR_PAGE_UP,
+    CMD_CURSOR_PAGE_DOWN,
+    CMD_CURSOR_LINE_BEGIN,
+    CMD_CURSOR_LINE_END,
+    CMD_CURSOR_BUFFER_BEGIN,
+    CMD_CURSOR_BUFFER_END,
+    /* Run by name from here on. */
+    CMD_FIND_NEXT_IN_BUFFER,
+    CMD_FIND_PREV_IN_BUFFER,
+    CMD_YANK_SELECTION,
+    CMD_DELETE_BACK,
+    CMD_DELETE_FORWARD,
+    CMD_PASTE_YANK_BUFFER,
+    CMD_UNDO,
+    CMD_REDO,
+    CMD_INSERT,
+    N_CMDS,
+};
+
+static char *cmd_names[] = {
+    "select-off",
+    "select",
+    "select-lines",
+    "select-rect",
+    "cursor-left",
+    "cursor-right",
+    "cursor-up",
+    "cursor-down",
+    "cursor-page-up",
+    "cursor-page-down",
+    "cursor-line-begin",
+    "cursor-line-end",
+    "cursor-buffer-begin",
+    "cursor-buffer-end",
+    "find-next-in-buffer",
+    "find-prev-in-buffer",
+    "yank-selection",
+    "delete-back",
+    "delete-forward",
+    "paste-yank-buffer",
+    "undo",
+    "redo",
+    "insert",
+};
+
+#define N_DIRECT_CMDS (CMD_FIND_NEXT_IN_BUFFER)
+
+static yed_command cmd_fns[N_CMDS];
+
+#define XEXE(cmd, ...)                                                      \
+do {                                                                        \
+    char *__XEXE_args[] = { __VA_ARGS__ };                                  \
+    xexe((cmd), sizeof(__XEXE_args) / sizeof(char*), __XEXE_args);          \
+} while (0)
+
+/* YEXE(), counted for xul-stats and traced like XEXE(). */
+#define YEXE_COUNTED(...)                                                   \
+do {                                                                        \
+    char *__YEXE_COUNTED_args[] = { __VA_ARGS__ };                          \
+    stats_cmds += 1;                                                        \
+    TRACE_BEGIN(__YEXE_COUNTED_args[0]);                                    \
+    YEXE(__VA_ARGS__);                                                      \
+    TRACE_END(__YEXE_COUNTED_args[0]);                                      \
+} while (0)
+
 static int mode_completion(char *string, yed_completion_results *results) {
     int status;
 
@@ -31,41 +137,275 @@ static int mode_completion(char *string, yed_completion_results *results) {
     return status;
 }
 
-typedef struct {
-    int    len;
-    int    keys[MAX_SEQ_LEN];
-    char  *cmd;
-    int    key;
-    int    n_args;
-    char **args;
+typedef struct key_binding_t {
+    int                   len;
+    int                   keys[MAX_SEQ_LEN];
+    char                 *cmd;
+    int                   n_args;
+    char                **args;
+    int                   mode;
+    int                   idx;  /* position in mode_bindings[mode] */
+    struct key_binding_t *next; /* next in binding_table bucket */
+    struct trie_node_t   *node;
 } key_binding;
 
+/*
+ * Each mode's bindings form a prefix trie of keys.  Nodes are found
+ * through trie_table, hashed on (parent, key), so following one key
+ * is O(1) no matter how many bindings share a prefix.
+ */
+typedef struct trie_node_t {
+    struct trie_node_t *parent;
+    int                 key;
+    int                 n_children;
+    key_binding        *binding;
+    struct trie_node_t *next; /* next in trie_table bucket */
+} trie_node;
+
+/*
+ * Where the last f/t/F/T target occurs on one line, so that ';' and ','
+ * can step between occurrences without scanning the line again.
+ * Dropped whenever that line (or the line numbering) changes.
+ */
+typedef struct {
+    int idx;
+    int col;
+    int width;
+} till_hit;
+
+typedef struct {
+    yed_buffer *buffer;
+    int         row;
+    char        target[4];
+    int         target_len;
+    array_t     hits; /* till_hit, in line order */
+    int         valid;
+    int         pos;  /* hit that the last repeat landed on */
+} till_index;
+
+/*
+ * Per-buffer indexes that motions search instead of walking lines.
+ * They are built on first use and then kept up to date from buffer
+ * modification events, until renumbering entries for inserted and
+ * deleted lines has cost about as much as building them again; then
+ * they are dropped and rebuilt on next use.
+ */
+#define WORD_CACHE_SIZE (64)
+
+typedef struct {
+    int start_col;
+    int end_col; /* column of the word's last glyph */
+} word_span;
+
+typedef struct {
+    int     row; /* 0 = empty slot */
+    array_t words; /* word_span, in line order */
+} word_line;
+
+typedef struct {
+    int  row;
+    int  col;
+    char c;
+    int  match; /* index of the matching bracket, -1 if none */
+} bracket_tok;
+
+typedef struct {
+    int row;
+    int col;
+    int end_col; /* exclusive */
+} search_match;
+
+/*
+ * One of several selections (see "multiple selections" below).
+ * The end column is exclusive; an empty range is a bare cursor.
+ */
+typedef struct {
+    int row1, col1;
+    int row2, col2;
+} xsel;
+
+typedef struct {
+    yed_buffer *buffer;
+    int         blank_valid;
+    array_t     blank_rows; /* int, sorted rows of blank lines */
+    word_line   word_lines[WORD_CACHE_SIZE]; /* direct mapped on row */
+    int         brackets_valid;
+    int         pairs_valid;
+    array_t     brackets; /* bracket_tok, in buffer order */
+    char       *search;   /* pattern the match index was built for */
+    array_t     matches;  /* search_match, in buffer order */
+    array_t     sels;     /* xsel, sorted and non-overlapping; empty = yed's own selection */
+    long long   shifted;  /* index entries renumbered since the indexes were last dropped */
+} buffer_cache;
+
 static yed_plugin *Self;
 static int         mode;
-static array_t     mode_bindings[N_MODES];
+static array_t     mode_bindings[N_MODES]; /* key_binding* */
+static till_index  till_idx;
+static array_t     buffer_caches; /* buffer_cache* */
+static int         sel_dirty; /* something happened that may have dropped the selection */
+static yed_frame  *sel_frame;
+static yed_buffer *sel_buffer;
 static int         till_pending; /* 0 = not pending, 1 = pending forward, 2 = pending backward, 3 = pending backward; stop before */
+static int         till_count;
 static int         last_till_key;
 static char        last_till_op;
+static char        last_till_bytes[4];
+static int         last_till_len;
 static int         num_undo_records_before_insert;
+static yed_buffer *insert_undo_buff; /* buffer with the insert session's undo record open */
 static int         restore_cursor_line;
 static int         visual;
+static int         count; /* numeric prefix being typed in normal mode, 0 = none */
 static int         last_nav_key;
+static int         last_nav_count;
 static int         save_nav_key;
+static int         save_nav_count;
 static int         save_action;
+static int         op_pending; /* 0 = not pending, otherwise the operator key ('c', 'd', or 'y') */
+static int         op_count;   /* count typed before the operator, 0 = none */
+static int         op_motion;  /* 'f', 't', 'F', 'T' waiting on the till key, or 'i', 'a' waiting on a text object */
+static int         textobj_pending; /* 'i' or 'a' after either in visual mode */
+static int         save_op_motion;
+static int         save_op_count;
+static int         save_op_till_key;
 static array_t     insert_repeat_keys;
+static array_t     repeat_text;       /* net text of the last insert session, if it was only text */
+static int         repeat_text_width;
+static int         repeat_text_ok;
+static array_t     insert_pending; /* typed text not yet put in the buffer */
+static int         insert_pending_width;
+static int         paste_begin_key;
+static int         paste_end_key;
+static int         pasting;
+static array_t     paste_text;
 static int         repeating;
+static array_t     macro_regs[26]; /* int keys, registers a-z */
+static int         macro_recording; /* register + 1 while recording */
+static int         macro_pending;   /* 'q' or '@' waiting for a register */
+static int         macro_count;
+static int         last_macro;      /* register + 1 of the last '@' */
+static int         macro_depth;     /* > 0 while a macro is replaying */
+static int         mode_vars_dirty;
+static int         redraw_dirty;
+static int         virt_line_sel; /* large buffer: the cursor line is drawn as selected instead */
+static int         virt_row;
+
+/* Bindings, hashed on mode + keys, and the trie of their key sequences. */
+static key_binding       **binding_table;
+static int                 binding_table_size;
+static int                 n_bindings;
+static trie_node           trie_roots[N_MODES];
+static trie_node         **trie_table;
+static int                 trie_table_size;
+static int                 n_trie_nodes;
+static trie_node          *seq_node; /* how far the keys typed so far go into the trie */
+static int                 seq_keys[MAX_SEQ_LEN];
+static int                 seq_len;
+static unsigned long long  seq_time; /* when the last key of the sequence came */
+
+static int         multi_editing; /* our own edits across selections are in progress */
+static array_t     multi_yanks;   /* char*, one per selection */
+
+static int         stats_on;
+static unsigned    stats_cmds; /* commands run for the key being timed */
+
+/*
+ * Tracing: begin/end events for the key handling functions and every
+ * command xul runs go into a fixed size ring (the oldest are dropped)
+ * and are written out as a Chrome/Perfetto JSON trace on request.
+ */
+typedef struct {
+    unsigned long long  ts;
+    const char         *name;
+    char                ph;
+} trace_event;
+
+static int                 trace_on;
+static trace_event        *trace_ring;
+static int                 trace_cap;
+static int                 trace_head;  /* next slot to write */
+static int                 trace_len;
+static unsigned long long  trace_start;
+static array_t             trace_names; /* char*, copies of binding command names */
+
+#define TRACE_BEGIN(_name) do { if (trace_on) { trace_add((_name), 'B'); } } while (0)
+#define TRACE_END(_name)   do { if (trace_on) { trace_add((_name), 'E'); } } while (0)
+
+/* A d, y, or p that runs a slice at a time (see chunk_step()). */
+enum {
+    CHUNK_COPY,
+    CHUNK_DELETE,
+    CHUNK_PASTE,
+};
+
+typedef struct {
+    int         op;      /* 'd', 'y', or 'p'; 0 when nothing is running */
+    int         phase;
+    yed_frame  *frame;
+    yed_buffer *buffer;
+    yed_buffer *yank;
+    int         kind;    /* RANGE_LINE or RANGE_NORMAL */
+    int         row1, col1, row2, col2;
+    int         next;    /* next row to copy or paste; rows left to delete */
+    int         undo;    /* our undo record is open */
+    int         p_row, p_col; /* where the next pasted slice goes */
+    int         save_hz; /* update rate to put back when done */
+} chunked_op;
+
+static chunked_op chunked;
 
 void unload(yed_plugin *self);
 void edraw(yed_event *event);
 void efocus(yed_event *event);
+void emark(yed_event *event);
+void emod(yed_event *event);
+void eline(yed_event *event);
+void eload(yed_event *event);
+void edelete(yed_event *event);
 void normal(int key);
 void insert(int key);
 void bind_keys(void);
 void change_mode(int new_mode);
 void enter_insert(void);
 void exit_insert(void);
+void flush_insert(void);
+void ekey(yed_event *event);
+static void _take_key(int key);
+static void take_key(int key);
+static void seq_timeout(void);
+static unsigned long long now_ns(void);
+static void record_key_stat(int key_mode, int key, unsigned long long ns, unsigned n_cmds);
+static void trace_add(const char *name, char ph);
+static const char *trace_name(const char *name);
+static void _edraw(void);
+static int  _nav_common(int key, int n);
+static void _normal(int key);
+static void request_redraw(void);
+static void select_cursor_line(void);
+static void paste_insert(char *text, int len);
+static void materialize_line_sel(void);
+static int  start_chunked(int op);
+static int  start_chunked_paste(void);
+static void chunk_stop(void);
+static void chunk_cancel(void);
+void epump(yed_event *event);
+static void set_mode_vars(void);
+static void record_repeat_text(int key);
+static void replay_insert(int n);
+static void update_search_index(buffer_cache *cache, yed_event *event);
+static buffer_cache *find_buffer_cache(yed_buffer *buff);
+void eplugin(yed_event *event);
+void resolve_commands(void);
+void xexe(int cmd, int n_args, char **args);
 void make_binding(int b_mode, int n_keys, int *keys, char *cmd, int n_args, char **args);
 void remove_binding(int b_mode, int n_keys, int *keys);
+void free_binding(key_binding *b);
+void free_trie(void);
+void free_buffer_cache(buffer_cache *cache);
+void stop_workers(void);
+void free_regex_cache(void);
+void free_stats(void);
 
 int yed_plugin_boot(yed_plugin *self) {
     int               i;
@@ -76,10 +416,21 @@ int yed_plugin_boot(yed_plugin *self) {
     Self = self;
 
     for (i = 0; i < N_MODES; i += 1) {
-        mode_bindings[i] = array_make(key_binding);
+        mode_bindings[i] = array_make(key_binding*);
     }
 
     insert_repeat_keys = array_make(int);
+    repeat_text        = array_make(char);
+    insert_pending     = array_make(char);
+    paste_text         = array_make(char);
+    till_idx.hits      = array_make(till_hit);
+    buffer_caches      = array_make(buffer_cache*);
+    multi_yanks        = array_make(char*);
+    trace_names        = array_make(char*);
+
+    for (i = 0; i < 26; i += 1) {
+        macro_regs[i] = array_make(int);
+    }
 
     yed_plugin_set_unload_fn(Self, unload);
 
@@ -91,16 +442,65 @@ int yed_plugin_boot(yed_plugin *self) {
     handler.fn   = efocus;
     yed_plugin_add_event_handler(self, handler);
 
+    handler.kind = EVENT_KEY_PRE_PRESS;
+    handler.fn   = ekey;
+    yed_plugin_add_event_handler(self, handler);
+
+    handler.kind = EVENT_CURSOR_POST_MOVE;
+    handler.fn   = emark;
+    yed_plugin_add_event_handler(self, handler);
+
+    handler.kind = EVENT_BUFFER_POST_MOD;
+    handler.fn   = emod;
+    yed_plugin_add_event_handler(self, handler);
+
+    handler.kind = EVENT_LINE_PRE_DRAW;
+    handler.fn   = eline;
+    yed_plugin_add_event_handler(self, handler);
+
+    handler.kind = EVENT_BUFFER_POST_LOAD;
+    handler.fn   = eload;
+    yed_plugin_add_event_handler(self, handler);
+
+    handler.kind = EVENT_BUFFER_PRE_DELETE;
+    handler.fn   = edelete;
+    yed_plugin_add_event_handler(self, handler);
+
+    handler.kind = EVENT_PLUGIN_POST_LOAD;
+    handler.fn   = eplugin;
+    yed_plugin_add_event_handler(self, handler);
+
+    handler.kind = EVENT_PLUGIN_POST_UNLOAD;
+    handler.fn   = eplugin;
+    yed_plugin_add_event_handler(self, handler);
+
+    handler.kind = EVENT_PRE_PUMP;
+    handler.fn   = epump;
+    yed_plugin_add_event_handler(self, handler);
+
     yed_plugin_set_command(Self, "xul-take-key",    xul_take_key);
     yed_plugin_set_command(Self, "xul-bind",        xul_bind);
     yed_plugin_set_command(Self, "xul-unbind",      xul_unbind);
     yed_plugin_set_command(Self, "xul-exit-insert", xul_exit_insert);
+    yed_plugin_set_command(Self, "xul-paste-begin", xul_paste_begin);
+    yed_plugin_set_command(Self, "xul-paste-end",   xul_paste_end);
+#ifdef XUL_BENCH
+    yed_plugin_set_command(Self, "xul-bench-dispatch", xul_bench_dispatch);
+#endif
+    yed_plugin_set_command(Self, "xul-select-matches", xul_select_matches);
+    yed_plugin_set_command(Self, "xul-select-regex",   xul_select_regex);
+    yed_plugin_set_command(Self, "xul-split-regex",    xul_split_regex);
+    yed_plugin_set_command(Self, "xul-keep-regex",     xul_keep_regex);
+    yed_plugin_set_command(Self, "xul-drop-regex",     xul_drop_regex);
+    yed_plugin_set_command(Self, "xul-stats",          xul_stats);
+    yed_plugin_set_command(Self, "xul-trace",          xul_trace);
 
     yed_plugin_set_completion(Self, "xul-mode", mode_completion);
     yed_plugin_set_completion(Self, "xul-bind-compl-arg-0", mode_completion);
     yed_plugin_set_completion(Self, "xul-bind-compl-arg-2", yed_get_completion("command"));
     yed_plugin_set_completion(Self, "xul-unbind-compl-arg-0", mode_completion);
 
+    resolve_commands();
     bind_keys();
 
     if (yed_get_var("xul-normal-attrs") == NULL) {
@@ -112,6 +512,15 @@ int yed_plugin_boot(yed_plugin *self) {
     if (yed_get_var("xul-insert-no-cursor-line") == NULL) {
         yed_set_var("xul-insert-no-cursor-line", "yes");
     }
+    if (yed_get_var("xul-large-buffer-lines") == NULL) {
+        yed_set_var("xul-large-buffer-lines", "1000000");
+    }
+    if (yed_get_var("xul-key-timeout") == NULL) {
+        yed_set_var("xul-key-timeout", "1000");
+    }
+    if (yed_get_var("xul-chunked-op-lines") == NULL) {
+        yed_set_var("xul-chunked-op-lines", "100000");
+    }
 
     change_mode(MODE_NORMAL);
     yed_set_var("xul-mode", mode_strs[mode]);
@@ -121,781 +530,5341 @@ int yed_plugin_boot(yed_plugin *self) {
 }
 
 void unload(yed_plugin *self) {
-    int          i, j;
-    key_binding *b;
+    int            i;
+    key_binding  **bit;
+    buffer_cache **cit;
+    char         **sit;
+
+    if (chunked.op) {
+        if (chunked.undo) {
+            yed_end_undo_record(chunked.frame, chunked.buffer);
+        }
+        chunk_stop();
+    }
 
     for (i = 0; i < N_MODES; i += 1) {
-        array_traverse(mode_bindings[i], b) {
-            if (b->args) {
-                for (j = 0; j < b->n_args; j += 1) {
-                    free(b->args[j]);
-                }
-                free(b->args);
-            }
-            free(b->cmd);
+        array_traverse(mode_bindings[i], bit) {
+            free_binding(*bit);
         }
         array_free(mode_bindings[i]);
     }
-}
 
-void edraw(yed_event *event) {
-    if (mode                     != MODE_NORMAL)        { return; }
-    if (ys->active_frame         == NULL)               { return; }
-    if (ys->active_frame->buffer == NULL)               { return; }
-    if (ys->active_frame->buffer->flags & BUFF_SPECIAL) { return; }
-    if (ys->active_frame->buffer->has_selection)        { return; }
+    free(binding_table);
+    free_trie();
 
-    visual = 0;
-    YEXE("select-lines");
-}
+    array_free(insert_repeat_keys);
+    array_free(repeat_text);
 
-void efocus(yed_event *event) {
-    if (mode                     != MODE_NORMAL)        { return; }
-    if (ys->active_frame         == NULL)               { return; }
-    if (ys->active_frame->buffer == NULL)               { return; }
-    if (ys->active_frame->buffer->flags & BUFF_SPECIAL) { return; }
+    for (i = 0; i < 26; i += 1) {
+        array_free(macro_regs[i]);
+    }
+    array_free(insert_pending);
+    array_free(paste_text);
+    array_free(till_idx.hits);
 
-    visual = 0;
+    array_traverse(buffer_caches, cit) {
+        free_buffer_cache(*cit);
+    }
+    array_free(buffer_caches);
 
-    if (ys->active_frame->buffer->has_selection) {
-        YEXE("select-off");
+    array_traverse(multi_yanks, sit) {
+        free(*sit);
     }
-}
+    array_free(multi_yanks);
+
+    stop_workers();
+    free_regex_cache();
+    free_stats();
+    free(trace_ring);
+    array_traverse(trace_names, sit) {
+        free(*sit);
+    }
+    array_free(trace_names);
 
-void bind_keys(void) {
-    int   meta_keys[2];
-    int   meta_key;
-    char *ctrl_h_is_bs;
-    char *ctrl_h_is_bs_cpy;
-    int   key;
-    char  key_str[32];
+    yed_unbind_key(paste_begin_key);
+    yed_delete_key_sequence(paste_begin_key);
+    yed_unbind_key(paste_end_key);
+    yed_delete_key_sequence(paste_end_key);
 
-    meta_keys[0] = ESC;
+    /* Turn off bracketed paste. */
+    append_to_output_buff("\e[?2004l");
+    flush_output_buff();
+}
 
-    meta_keys[1] = ARROW_UP;
-    meta_key     = yed_get_key_sequence(2, meta_keys);
-    yed_unbind_key(meta_key);
-    yed_delete_key_sequence(meta_key);
-    meta_keys[1] = ARROW_DOWN;
-    meta_key     = yed_get_key_sequence(2, meta_keys);
-    yed_unbind_key(meta_key);
-    yed_delete_key_sequence(meta_key);
-    meta_keys[1] = ARROW_RIGHT;
-    meta_key     = yed_get_key_sequence(2, meta_keys);
-    yed_unbind_key(meta_key);
-    yed_delete_key_sequence(meta_key);
-    meta_keys[1] = ARROW_LEFT;
-    meta_key     = yed_get_key_sequence(2, meta_keys);
-    yed_unbind_key(meta_key);
-    yed_delete_key_sequence(meta_key);
+void edraw(yed_event *event) {
+    TRACE_BEGIN("edraw");
+    _edraw();
+    TRACE_END("edraw");
+}
 
-    if ((ctrl_h_is_bs = yed_get_var("ctrl-h-is-backspace"))) {
-        ctrl_h_is_bs_cpy = strdup(ctrl_h_is_bs);
-        yed_unset_var("ctrl-h-is-backspace");
-    }
+static void _edraw(void) {
+    buffer_cache *cache;
 
-    for (key = 1; key < REAL_KEY_MAX; key += 1) {
-        snprintf(key_str, sizeof(key_str), "%d", key);
-        YPBIND(Self, key, "xul-take-key", key_str);
+    if (array_len(insert_pending)) {
+        flush_insert();
     }
 
-    if (ctrl_h_is_bs) {
-        yed_set_var("ctrl-h-is-backspace", ctrl_h_is_bs_cpy);
-        free(ctrl_h_is_bs_cpy);
+    /* The selection is put back when the chunked operator is done. */
+    if (chunked.op) { return; }
+
+    /*
+     * The selection can only have gone away if a key was pressed, a
+     * cursor moved, a buffer changed, or a different frame/buffer is
+     * active.  Otherwise there's nothing to check.
+     */
+    if (!sel_dirty
+    &&  ys->active_frame == sel_frame
+    &&  (sel_frame == NULL || sel_frame->buffer == sel_buffer)) {
+        return;
     }
-}
-
-void change_mode(int new_mode) {
-    char         key_str[32];
-    key_binding *b;
 
-    array_traverse(mode_bindings[mode], b) {
-        yed_unbind_key(b->key);
-        if (b->len > 1) {
-            yed_delete_key_sequence(b->key);
-        } else if (b->key < REAL_KEY_MAX) {
-            snprintf(key_str, sizeof(key_str), "%d", b->key);
-            YPBIND(Self, b->key, "xul-take-key", key_str);
-        }
-    }
+    sel_dirty  = 0;
+    sel_frame  = ys->active_frame;
+    sel_buffer = sel_frame ? sel_frame->buffer : NULL;
 
-    array_traverse(mode_bindings[new_mode], b) {
-        if (b->len > 1) {
-            b->key = yed_plugin_add_key_sequence(Self, b->len, b->keys);
-        } else {
-            b->key = b->keys[0];
-        }
+    if (mode                     != MODE_NORMAL)        { return; }
+    if (ys->active_frame         == NULL)               { return; }
+    if (ys->active_frame->buffer == NULL)               { return; }
+    if (ys->active_frame->buffer->flags & BUFF_SPECIAL) { return; }
+    if (ys->active_frame->buffer->has_selection)        { return; }
 
-        yed_plugin_bind_key(Self, b->key, b->cmd, b->n_args, b->args);
+    if ((cache = find_buffer_cache(ys->active_frame->buffer)) != NULL
+    &&  array_len(cache->sels)) {
+        return;
     }
 
     visual = 0;
+    select_cursor_line();
+}
 
-    switch (mode) {
-        case MODE_NORMAL:                      break;
-        case MODE_INSERT: exit_insert();       break;
-    }
-
-    mode = new_mode;
+void emark(yed_event *event) {
+    sel_dirty = 1;
 
-    switch (new_mode) {
-        case MODE_NORMAL: {
-            break;
-        }
-        case MODE_INSERT: enter_insert();        break;
+    /* The line drawn as selected changed, so the old one has to be redrawn too. */
+    if (virt_line_sel
+    &&  event->frame == ys->active_frame
+    &&  event->frame->cursor_line != virt_row) {
+        virt_row = event->frame->cursor_line;
+        request_redraw();
     }
+}
 
-    yed_set_var("xul-mode", mode_strs[new_mode]);
+static int mod_shifts_lines(yed_event *event) {
+    switch (event->buff_mod_event) {
+        case BUFF_MOD_INSERT_LINE:
+        case BUFF_MOD_DELETE_LINE:
+        case BUFF_MOD_CLEAR:
+            return 1;
+    }
+    return 0;
+}
 
-    yed_set_var("xul-mode-attrs", yed_get_var("xul-insert-attrs"));
+static buffer_cache *find_buffer_cache(yed_buffer *buff) {
+    buffer_cache **cit;
 
-    switch (new_mode) {
-        case MODE_NORMAL: yed_set_var("xul-mode-attrs", yed_get_var("xul-normal-attrs")); break;
-        case MODE_INSERT: yed_set_var("xul-mode-attrs", yed_get_var("xul-insert-attrs")); break;
+    array_traverse(buffer_caches, cit) {
+        if ((*cit)->buffer == buff) {
+            return *cit;
+        }
     }
+
+    return NULL;
 }
 
-static void _take_key(int key, char *maybe_key_str) {
-    char *key_str, buff[32];
+static buffer_cache *get_buffer_cache(yed_buffer *buff) {
+    buffer_cache *cache;
+    int           i;
 
-    if (maybe_key_str) {
-        key_str = maybe_key_str;
-    } else {
-        snprintf(buff, sizeof(buff), "%d", key);
-        key_str = buff;
+    if ((cache = find_buffer_cache(buff)) != NULL) {
+        return cache;
     }
 
-    switch (mode) {
-        case MODE_NORMAL: normal(key); break;
-        case MODE_INSERT: insert(key); break;
-        default:
-            LOG_FN_ENTER();
-            yed_log("[!] invalid mode (?)");
-            LOG_EXIT();
-    }
-}
+    cache = calloc(1, sizeof(*cache));
 
-void xul_take_key(int n_args, char **args) {
-    int key;
+    cache->buffer     = buff;
+    cache->blank_rows = array_make(int);
+    cache->brackets   = array_make(bracket_tok);
+    cache->matches    = array_make(search_match);
+    cache->sels       = array_make(xsel);
 
-    if (n_args != 1) {
-        yed_cerr("expected 1 argument, but got %d", n_args);
-        return;
+    for (i = 0; i < WORD_CACHE_SIZE; i += 1) {
+        cache->word_lines[i].words = array_make(word_span);
     }
 
-    sscanf(args[0], "%d", &key);
+    array_push(buffer_caches, cache);
 
-    _take_key(key, args[0]);
+    return cache;
 }
 
-void xul_bind(int n_args, char **args) {
-    char *mode_str, *cmd;
-    int   b_mode, n_keys, keys[MAX_SEQ_LEN], n_cmd_args;
-
-    if (n_args < 1) {
-        yed_cerr("missing 'mode' as first argument");
-        return;
-    }
+/* Forget what is indexed for a buffer; each index is rebuilt on next use. */
+static void drop_indexes(buffer_cache *cache) {
+    int i;
 
-    mode_str = args[0];
+    cache->blank_valid    = 0;
+    cache->brackets_valid = 0;
+    cache->pairs_valid    = 0;
+    cache->shifted        = 0;
 
-    if      (strcmp(mode_str, "normal") == 0)    { b_mode = MODE_NORMAL; }
-    else if (strcmp(mode_str, "insert") == 0)    { b_mode = MODE_INSERT; }
-    else {
-        yed_cerr("no mode named '%s'", mode_str);
-        return;
+    if (cache->search != NULL) {
+        free(cache->search);
+        cache->search = NULL;
     }
 
-    if (n_args < 2) {
-        yed_cerr("missing 'keys' as second argument");
-        return;
+    for (i = 0; i < WORD_CACHE_SIZE; i += 1) {
+        cache->word_lines[i].row = 0;
     }
+}
 
-    if (n_args < 3) {
-        yed_cerr("missing 'command', 'command_args'... as third and up arguments");
-        return;
-    }
+void free_buffer_cache(buffer_cache *cache) {
+    int i;
 
-    n_keys = yed_string_to_keys(args[1], keys);
-    if (n_keys == -1) {
-        yed_cerr("invalid string of keys '%s'", args[1]);
-        return;
-    }
-    if (n_keys == -2) {
-        yed_cerr("too many keys to be a sequence in '%s'", args[1]);
-        return;
-    }
+    array_free(cache->blank_rows);
+    array_free(cache->brackets);
+    array_free(cache->matches);
+    array_free(cache->sels);
+    if (cache->search != NULL) { free(cache->search); }
 
-    cmd = args[2];
+    for (i = 0; i < WORD_CACHE_SIZE; i += 1) {
+        array_free(cache->word_lines[i].words);
+    }
 
-    n_cmd_args = n_args - 3;
-    make_binding(b_mode, n_keys, keys, cmd, n_cmd_args, args + 3);
+    free(cache);
 }
 
-void xul_unbind(int n_args, char **args) {
-    char *mode_str;
-    int   b_mode, n_keys, keys[MAX_SEQ_LEN];
+static int line_is_blank(yed_line *line) {
+    char *data;
+    int   len;
+    int   i;
 
-    if (n_args < 1) {
-        yed_cerr("missing 'mode' as first argument");
-        return;
-    }
+    if (line == NULL) { return 1; }
 
-    mode_str = args[0];
+    data = array_data(line->glyphs);
+    len  = array_len(line->glyphs);
 
-    if      (strcmp(mode_str, "normal") == 0)    { b_mode = MODE_NORMAL; }
-    else if (strcmp(mode_str, "insert") == 0)    { b_mode = MODE_INSERT; }
-    else {
-        yed_cerr("no mode named '%s'", mode_str);
-        return;
+    for (i = 0; i < len; i += 1) {
+        if (data[i] != ' ' && data[i] != '\t') {
+            return 0;
+        }
     }
 
-    if (n_args != 2) {
-        yed_cerr("missing 'keys' as second argument");
-        return;
-    }
+    return 1;
+}
 
-    n_keys = yed_string_to_keys(args[1], keys);
-    if (n_keys == -1) {
-        yed_cerr("invalid string of keys '%s'", args[1]);
-        return;
-    }
-    if (n_keys == -2) {
-        yed_cerr("too many keys to be a sequence in '%s'", args[1]);
-        return;
+/* Index of the first element of a sorted int array that is >= val. */
+static int lower_bound(array_t *arr, int val) {
+    int *data;
+    int  lo;
+    int  hi;
+    int  mid;
+
+    data = array_data(*arr);
+    lo   = 0;
+    hi   = array_len(*arr);
+
+    while (lo < hi) {
+        mid = lo + ((hi - lo) / 2);
+        if (data[mid] < val) { lo = mid + 1; }
+        else                 { hi = mid;     }
     }
 
-    remove_binding(b_mode, n_keys, keys);
+    return lo;
 }
 
-void make_binding(int b_mode, int n_keys, int *keys, char *cmd, int n_args, char **args) {
-    int         i;
-    key_binding binding, *b;
+static void build_blank_index(buffer_cache *cache) {
+    int       row;
+    int       n_lines;
+    yed_line *line;
 
-    if (n_keys <= 0) {
-        return;
-    }
+    array_clear(cache->blank_rows);
 
-    binding.len = n_keys;
-    for (i = 0; i < n_keys; i += 1) {
-        binding.keys[i] = keys[i];
-    }
-    binding.cmd = strdup(cmd);
-    binding.key = KEY_NULL;
-    binding.n_args = n_args;
-    if (n_args) {
-        binding.args = malloc(sizeof(char*) * n_args);
-        for (i = 0; i < n_args; i += 1) {
-            binding.args[i] = strdup(args[i]);
+    n_lines = yed_buff_n_lines(cache->buffer);
+
+    for (row = 1; row <= n_lines; row += 1) {
+        line = yed_buff_get_line(cache->buffer, row);
+        if (line_is_blank(line)) {
+            array_push(cache->blank_rows, row);
         }
-    } else {
-        binding.args = NULL;
     }
 
-    array_push(mode_bindings[b_mode], binding);
+    cache->blank_valid = 1;
+}
 
-    if (b_mode == mode) {
-        array_traverse(mode_bindings[mode], b) {
-            yed_unbind_key(b->key);
-            if (b->len > 1) {
-                yed_delete_key_sequence(b->key);
+static void update_blank_index(buffer_cache *cache, yed_event *event) {
+    int  i;
+    int  n;
+    int *rows;
+    int  row;
+    int  is_blank;
+    int  was_blank;
+
+    if (!cache->blank_valid) { return; }
+
+    row = event->row;
+    i   = lower_bound(&cache->blank_rows, row);
+    n   = array_len(cache->blank_rows);
+
+    switch (event->buff_mod_event) {
+        case BUFF_MOD_CLEAR:
+            cache->blank_valid = 0;
+            return;
+
+        case BUFF_MOD_INSERT_LINE:
+        case BUFF_MOD_ADD_LINE:
+            cache->shifted += n - i;
+            rows            = array_data(cache->blank_rows);
+            for (; i < n; i += 1) {
+                rows[i] += 1;
             }
-        }
-
-        array_traverse(mode_bindings[mode], b) {
-            if (b->len > 1) {
-                b->key = yed_plugin_add_key_sequence(Self, b->len, b->keys);
-            } else {
-                b->key = b->keys[0];
+            i = lower_bound(&cache->blank_rows, row);
+            array_insert(cache->blank_rows, i, row);
+            return;
+
+        case BUFF_MOD_DELETE_LINE:
+            if (i < n && *(int*)array_item(cache->blank_rows, i) == row) {
+                array_delete(cache->blank_rows, i);
+                n -= 1;
             }
-
-            yed_plugin_bind_key(Self, b->key, b->cmd, b->n_args, b->args);
-        }
+            cache->shifted += n - i;
+            rows            = array_data(cache->blank_rows);
+            for (; i < n; i += 1) {
+                rows[i] -= 1;
+            }
+            return;
     }
-}
 
-void remove_binding(int b_mode, int n_keys, int *keys) {
-    int          i;
-    key_binding *b;
+    /* The contents of one line changed. */
+    was_blank = i < n && *(int*)array_item(cache->blank_rows, i) == row;
+    is_blank  = line_is_blank(yed_buff_get_line(event->buffer, row));
 
-    if (n_keys <= 0) {
-        return;
+    if (is_blank && !was_blank) {
+        array_insert(cache->blank_rows, i, row);
+    } else if (!is_blank && was_blank) {
+        array_delete(cache->blank_rows, i);
     }
+}
 
-    i = 0;
-    array_traverse(mode_bindings[b_mode], b) {
-        if (b->len == n_keys
-        &&  memcmp(b->keys, keys, n_keys * sizeof(int)) == 0) {
+static void invalidate_words(buffer_cache *cache, yed_event *event) {
+    int        i;
+    word_line *wl;
+
+    if (mod_shifts_lines(event)) {
+        for (i = 0; i < WORD_CACHE_SIZE; i += 1) {
+            cache->word_lines[i].row = 0;
+        }
+    } else {
+        wl = &cache->word_lines[event->row & (WORD_CACHE_SIZE - 1)];
+        if (wl->row == event->row) {
+            wl->row = 0;
+        }
+    }
+}
+
+static int glyph_class(yed_glyph *g) {
+    if (g->c == ' ' || g->c == '\t')                        { return 0; }
+    if ((g->u_c & 0x80) || isalnum(g->u_c) || g->c == '_') { return 1; }
+    return 2;
+}
+
+/* The words on a line, from the cache or found with one pass over its glyphs. */
+static array_t *line_words(buffer_cache *cache, int row) {
+    word_line *wl;
+    yed_line  *line;
+    char      *data;
+    int        len;
+    int        idx;
+    int        col;
+    int        prev_col;
+    int        cls;
+    int        prev_cls;
+    yed_glyph *g;
+    word_span  span;
+
+    wl = &cache->word_lines[row & (WORD_CACHE_SIZE - 1)];
+
+    if (wl->row == row) { return &wl->words; }
+
+    wl->row = row;
+    array_clear(wl->words);
+
+    line = yed_buff_get_line(cache->buffer, row);
+
+    if (line == NULL) { return &wl->words; }
+
+    data     = array_data(line->glyphs);
+    len      = array_len(line->glyphs);
+    idx      = 0;
+    col      = 1;
+    prev_col = 0;
+    prev_cls = 0;
+
+    while (idx < len) {
+        g   = (yed_glyph*)(data + idx);
+        cls = glyph_class(g);
+
+        if (cls != prev_cls) {
+            if (prev_cls != 0) {
+                span.end_col = prev_col;
+                array_push(wl->words, span);
+            }
+            span.start_col = col;
+        }
+
+        prev_cls  = cls;
+        prev_col  = col;
+        col      += yed_get_glyph_width(g);
+        idx      += yed_get_glyph_len(g);
+    }
+
+    if (prev_cls != 0) {
+        span.end_col = prev_col;
+        array_push(wl->words, span);
+    }
+
+    return &wl->words;
+}
+
+static int is_open_bracket(char c)  { return c == '(' || c == '[' || c == '{'; }
+static int is_close_bracket(char c) { return c == ')' || c == ']' || c == '}'; }
+
+static char bracket_partner(char c) {
+    switch (c) {
+        case '(': return ')';
+        case '[': return ']';
+        case '{': return '}';
+        case ')': return '(';
+        case ']': return '[';
+        case '}': return '{';
+    }
+    return 0;
+}
+
+/* Index of the first bracket at or after row/col. */
+static int bracket_lower_bound(buffer_cache *cache, int row, int col) {
+    bracket_tok *toks;
+    int          lo;
+    int          hi;
+    int          mid;
+
+    toks = array_data(cache->brackets);
+    lo   = 0;
+    hi   = array_len(cache->brackets);
+
+    while (lo < hi) {
+        mid = lo + ((hi - lo) / 2);
+        if (toks[mid].row < row || (toks[mid].row == row && toks[mid].col < col)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/* Insert the brackets on one line at position i of the index. */
+static void scan_line_brackets(buffer_cache *cache, int row, int i) {
+    yed_line    *line;
+    char        *data;
+    int          len;
+    int          idx;
+    int          col;
+    yed_glyph   *g;
+    bracket_tok  tok;
+
+    line = yed_buff_get_line(cache->buffer, row);
+
+    if (line == NULL) { return; }
+
+    data = array_data(line->glyphs);
+    len  = array_len(line->glyphs);
+    idx  = 0;
+    col  = 1;
+
+    tok.row   = row;
+    tok.match = -1;
+
+    while (idx < len) {
+        g = (yed_glyph*)(data + idx);
+
+        if (is_open_bracket(g->c) || is_close_bracket(g->c)) {
+            tok.col = col;
+            tok.c   = g->c;
+            array_insert(cache->brackets, i, tok);
+            i += 1;
+        }
+
+        col += yed_get_glyph_width(g);
+        idx += yed_get_glyph_len(g);
+    }
+}
+
+static void build_bracket_index(buffer_cache *cache) {
+    int row;
+    int n_lines;
+
+    array_clear(cache->brackets);
+
+    n_lines = yed_buff_n_lines(cache->buffer);
+
+    for (row = 1; row <= n_lines; row += 1) {
+        scan_line_brackets(cache, row, array_len(cache->brackets));
+    }
+
+    cache->brackets_valid = 1;
+    cache->pairs_valid    = 0;
+}
+
+/*
+ * Keep the bracket positions current: only the modified line is
+ * scanned again, and inserted/deleted lines renumber the brackets
+ * after them.  Pairing is redone lazily over the bracket list alone.
+ */
+static void update_bracket_index(buffer_cache *cache, yed_event *event) {
+    bracket_tok *toks;
+    int          row;
+    int          i;
+    int          n;
+
+    if (!cache->brackets_valid) { return; }
+
+    cache->pairs_valid = 0;
+
+    if (event->buff_mod_event == BUFF_MOD_CLEAR) {
+        cache->brackets_valid = 0;
+        return;
+    }
+
+    row = event->row;
+    i   = bracket_lower_bound(cache, row, 0);
+
+    if (event->buff_mod_event != BUFF_MOD_INSERT_LINE
+    &&  event->buff_mod_event != BUFF_MOD_ADD_LINE) {
+        /* Drop the old brackets on this line. */
+        while (i < array_len(cache->brackets)
+        &&     ((bracket_tok*)array_item(cache->brackets, i))->row == row) {
+            array_delete(cache->brackets, i);
+        }
+    }
+
+    toks = array_data(cache->brackets);
+    n    = array_len(cache->brackets);
+
+    switch (event->buff_mod_event) {
+        case BUFF_MOD_INSERT_LINE:
+        case BUFF_MOD_ADD_LINE:
+            cache->shifted += n - i;
+            for (; i < n; i += 1) { toks[i].row += 1; }
+            break;
+        case BUFF_MOD_DELETE_LINE:
+            cache->shifted += n - i;
+            for (; i < n; i += 1) { toks[i].row -= 1; }
+            break;
+        default:
+            scan_line_brackets(cache, row, i);
+            break;
+    }
+}
+
+static void match_brackets(buffer_cache *cache) {
+    bracket_tok *toks;
+    int          n;
+    int          i;
+    array_t      stack;
+    int         *top;
+
+    toks  = array_data(cache->brackets);
+    n     = array_len(cache->brackets);
+    stack = array_make(int);
+
+    for (i = 0; i < n; i += 1) {
+        toks[i].match = -1;
+
+        if (is_open_bracket(toks[i].c)) {
+            array_push(stack, i);
+        } else if ((top = array_last(stack)) != NULL
+               &&  toks[*top].c == bracket_partner(toks[i].c)) {
+            toks[i].match    = *top;
+            toks[*top].match = i;
+            array_pop(stack);
+        }
+    }
+
+    array_free(stack);
+
+    cache->pairs_valid = 1;
+}
+
+static buffer_cache *bracket_index(yed_buffer *buff) {
+    buffer_cache *cache;
+
+    cache = get_buffer_cache(buff);
+
+    if (!cache->brackets_valid) { build_bracket_index(cache); }
+    if (!cache->pairs_valid)    { match_brackets(cache);      }
+
+    return cache;
+}
+
+/*
+ * The open bracket of the nth pair of type open_c around row/col, or -1.
+ * Walks back from the cursor, hopping over closed pairs through their
+ * match, so only enclosing levels and siblings are visited.
+ */
+static int enclosing_bracket(buffer_cache *cache, char open_c, int row, int col, int n) {
+    bracket_tok *toks;
+    int          len;
+    int          p;
+    int          i;
+
+    toks = array_data(cache->brackets);
+    len  = array_len(cache->brackets);
+    p    = bracket_lower_bound(cache, row, col);
+    i    = p - 1;
+
+    if (p < len && toks[p].row == row && toks[p].col == col && toks[p].match >= 0) {
+        /* On a bracket of the right kind: that pair is the first level. */
+        if (toks[p].c == open_c) {
+            i = p;
+        } else if (toks[p].c == bracket_partner(open_c)) {
+            i = toks[p].match;
+        }
+    }
+
+    for (; i >= 0; i -= 1) {
+        if (is_close_bracket(toks[i].c) && toks[i].match >= 0 && toks[i].match < i) {
+            i = toks[i].match;
+            continue;
+        }
+        if (toks[i].c == open_c && toks[i].match >= 0 && toks[i].match >= i) {
+            n -= 1;
+            if (n == 0) { return i; }
+        }
+    }
+
+    return -1;
+}
+
+static buffer_cache *blank_index(yed_buffer *buff) {
+    buffer_cache *cache;
+    int           n;
+
+    cache = get_buffer_cache(buff);
+
+    n = array_len(cache->blank_rows);
+
+    if (cache->blank_valid
+    &&  n > 0
+    &&  *(int*)array_item(cache->blank_rows, n - 1) > yed_buff_n_lines(buff)) {
+        /* Missed an update somehow. */
+        cache->blank_valid = 0;
+    }
+
+    if (!cache->blank_valid) {
+        build_blank_index(cache);
+    }
+
+    return cache;
+}
+
+void emod(yed_event *event) {
+    buffer_cache *cache;
+
+    sel_dirty = 1;
+
+    if (till_idx.valid
+    &&  event->buffer == till_idx.buffer
+    &&  (event->row == till_idx.row || mod_shifts_lines(event))) {
+        till_idx.valid = 0;
+    }
+
+    if ((cache = find_buffer_cache(event->buffer)) != NULL) {
+        update_blank_index(cache, event);
+        invalidate_words(cache, event);
+        update_bracket_index(cache, event);
+        update_search_index(cache, event);
+
+        /*
+         * Each inserted or deleted line renumbers every entry after it,
+         * so a bulk edit ("50000dd") would cost lines x entries.  Once
+         * that has added up to about a rebuild, stop keeping them.
+         */
+        if (cache->shifted > yed_buff_n_lines(event->buffer)) {
+            drop_indexes(cache);
+        }
+
+        /* Someone else changed the text: the selections no longer line up. */
+        if (!multi_editing && array_len(cache->sels)) {
+            array_clear(cache->sels);
+        }
+    }
+}
+
+/* Index of the first selection that ends on or after row. */
+static int sel_lower_bound(buffer_cache *cache, int row) {
+    xsel *sels;
+    int   lo;
+    int   hi;
+    int   mid;
+
+    sels = array_data(cache->sels);
+    lo   = 0;
+    hi   = array_len(cache->sels);
+
+    while (lo < hi) {
+        mid = lo + ((hi - lo) / 2);
+        if (sels[mid].row2 < row) { lo = mid + 1; }
+        else                      { hi = mid;     }
+    }
+
+    return lo;
+}
+
+/*
+ * Draw the multiple selections (cursors get one highlighted cell), or
+ * the cursor line of a large buffer.
+ */
+void eline(yed_event *event) {
+    buffer_cache *cache;
+    xsel         *sels;
+    int           n;
+    int           i;
+    int           from;
+    int           to;
+    int           col;
+    yed_attrs     attr;
+
+    if (event->frame == NULL || event->frame->buffer == NULL)               { return; }
+
+    cache = find_buffer_cache(event->frame->buffer);
+    attr  = yed_active_style_get_selection();
+
+    if (virt_line_sel
+    &&  mode                == MODE_NORMAL
+    &&  event->frame        == ys->active_frame
+    &&  event->row          == event->frame->cursor_line
+    &&  !event->frame->buffer->has_selection
+    &&  (cache == NULL || array_len(cache->sels) == 0)) {
+
+        for (col = 1; col <= array_len(event->line_attrs); col += 1) {
+            yed_combine_attrs(array_item(event->line_attrs, col - 1), &attr);
+        }
+        return;
+    }
+
+    if (cache == NULL)                                                      { return; }
+    if ((n = array_len(cache->sels)) == 0)                                  { return; }
+
+    sels = array_data(cache->sels);
+
+    i = sel_lower_bound(cache, event->row);
+
+    for (; i < n && sels[i].row1 <= event->row; i += 1) {
+        from = sels[i].row1 == event->row ? sels[i].col1 : 1;
+        to   = sels[i].row2 == event->row ? sels[i].col2 : array_len(event->line_attrs) + 1;
+        if (to <= from) { to = from + 1; }
+
+        for (col = from; col < to && col <= array_len(event->line_attrs); col += 1) {
+            yed_combine_attrs(array_item(event->line_attrs, col - 1), &attr);
+        }
+    }
+}
+
+void eload(yed_event *event) {
+    buffer_cache *cache;
+    int           i;
+
+    if ((cache = find_buffer_cache(event->buffer)) != NULL) {
+        cache->blank_valid    = 0;
+        cache->brackets_valid = 0;
+        if (cache->search != NULL) {
+            free(cache->search);
+            cache->search = NULL;
+        }
+        for (i = 0; i < WORD_CACHE_SIZE; i += 1) {
+            cache->word_lines[i].row = 0;
+        }
+    }
+}
+
+void edelete(yed_event *event) {
+    int            i;
+    buffer_cache **cit;
+
+    i = 0;
+    array_traverse(buffer_caches, cit) {
+        if ((*cit)->buffer == event->buffer) {
+            free_buffer_cache(*cit);
+            array_delete(buffer_caches, i);
+            break;
+        }
+        i += 1;
+    }
+
+    if (till_idx.buffer == event->buffer) {
+        till_idx.valid  = 0;
+        till_idx.buffer = NULL;
+    }
+
+    if (insert_undo_buff == event->buffer) {
+        insert_undo_buff = NULL;
+    }
+
+    if (chunked.op && (chunked.buffer == event->buffer || chunked.yank == event->buffer)) {
+        /* Only *yank is going: close the record so later edits don't land in it. */
+        if (chunked.undo && chunked.buffer != event->buffer) {
+            yed_end_undo_record(chunked.frame, chunked.buffer);
+        }
+        chunk_stop();
+    }
+}
+
+void efocus(yed_event *event) {
+    if (array_len(insert_pending)) {
+        flush_insert();
+    }
+
+    sel_dirty = 1;
+
+    if (mode                     != MODE_NORMAL)        { return; }
+    if (ys->active_frame         == NULL)               { return; }
+    if (ys->active_frame->buffer == NULL)               { return; }
+    if (ys->active_frame->buffer->flags & BUFF_SPECIAL) { return; }
+
+    visual = 0;
+
+    if (ys->active_frame->buffer->has_selection) {
+        XEXE(CMD_SELECT_OFF);
+    }
+}
+
+void resolve_commands(void) {
+    int i;
+
+    for (i = 0; i < N_DIRECT_CMDS; i += 1) {
+        cmd_fns[i] = yed_get_command(cmd_names[i]);
+    }
+}
+
+void eplugin(yed_event *event) {
+    /* A plugin may have added, replaced, or removed one of our commands. */
+    resolve_commands();
+}
+
+void xexe(int cmd, int n_args, char **args) {
+    stats_cmds += 1;
+
+    TRACE_BEGIN(cmd_names[cmd]);
+
+    if (cmd_fns[cmd] != NULL) {
+        cmd_fns[cmd](n_args, args);
+    } else {
+        yed_execute_command(cmd_names[cmd], n_args, args);
+    }
+
+    TRACE_END(cmd_names[cmd]);
+}
+
+void ekey(yed_event *event) {
+    yed_glyph       *g;
+    char             c;
+    yed_key_binding *b;
+
+    sel_dirty = 1;
+
+    if (chunked.op) {
+        /* Only CTRL_C (cancel) gets through while a chunked operator runs. */
+        event->cancel = 1;
+        if (event->key == CTRL_C) {
+            chunk_cancel();
+        }
+        return;
+    }
+
+    if (pasting && event->key != paste_end_key) {
+        /*
+         * Inside a bracketed paste, keys are only collected.
+         * Nothing is dispatched, recorded, or undone per key.
+         */
+        if (event->key == MBYTE) {
+            g = &ys->mbyte;
+            array_push_n(paste_text, g->bytes, yed_get_glyph_len(g));
+        } else if (event->key == ENTER || event->key == TAB
+               ||  (event->key < 128 && !iscntrl(event->key))) {
+            c = event->key == ENTER ? '\n' : event->key;
+            array_push(paste_text, c);
+        }
+        event->cancel = 1;
+        return;
+    }
+
+    /*
+     * Anything other than plain text may be bound to a command that
+     * looks at the buffer, so make sure it sees what has been typed.
+     */
+    if (array_len(insert_pending)
+    &&  (event->key >= 128 || !isprint(event->key))) {
+        flush_insert();
+    }
+
+    if (ys->interactive_command) { return; }
+
+    /*
+     * Keys that are still bound to xul-take-key are dispatched here
+     * with the integer key, so no argument string is built or parsed
+     * per keystroke.  Keys that something else has been bound to are
+     * left to the core.
+     */
+    b = yed_get_key_binding(event->key);
+    if (b == NULL) { return; }
+
+    if (b->n_args != 0
+    ||  strcmp(b->cmd, "xul-take-key") != 0) {
+        /* Someone else's command may want the selection and the typed text. */
+        flush_insert();
+        materialize_line_sel();
+        return;
+    }
+
+    event->cancel = 1;
+    take_key(event->key);
+}
+
+void bind_keys(void) {
+    int   meta_keys[2];
+    int   meta_key;
+    char *ctrl_h_is_bs;
+    char *ctrl_h_is_bs_cpy;
+    int   key;
+    int   paste_keys[6];
+
+    meta_keys[0] = ESC;
+
+    meta_keys[1] = ARROW_UP;
+    meta_key     = yed_get_key_sequence(2, meta_keys);
+    yed_unbind_key(meta_key);
+    yed_delete_key_sequence(meta_key);
+    meta_keys[1] = ARROW_DOWN;
+    meta_key     = yed_get_key_sequence(2, meta_keys);
+    yed_unbind_key(meta_key);
+    yed_delete_key_sequence(meta_key);
+    meta_keys[1] = ARROW_RIGHT;
+    meta_key     = yed_get_key_sequence(2, meta_keys);
+    yed_unbind_key(meta_key);
+    yed_delete_key_sequence(meta_key);
+    meta_keys[1] = ARROW_LEFT;
+    meta_key     = yed_get_key_sequence(2, meta_keys);
+    yed_unbind_key(meta_key);
+    yed_delete_key_sequence(meta_key);
+
+    if ((ctrl_h_is_bs = yed_get_var("ctrl-h-is-backspace"))) {
+        ctrl_h_is_bs_cpy = strdup(ctrl_h_is_bs);
+        yed_unset_var("ctrl-h-is-backspace");
+    }
+
+    for (key = 1; key < REAL_KEY_MAX; key += 1) {
+        yed_plugin_bind_key(Self, key, "xul-take-key", 0, NULL);
+    }
+
+    if (ctrl_h_is_bs) {
+        yed_set_var("ctrl-h-is-backspace", ctrl_h_is_bs_cpy);
+        free(ctrl_h_is_bs_cpy);
+    }
+
+    /* Bracketed paste: ESC[200~ ... ESC[201~ */
+    paste_keys[0] = ESC;
+    paste_keys[1] = '[';
+    paste_keys[2] = '2';
+    paste_keys[3] = '0';
+    paste_keys[4] = '0';
+    paste_keys[5] = '~';
+    paste_begin_key = yed_plugin_add_key_sequence(Self, 6, paste_keys);
+    YPBIND(Self, paste_begin_key, "xul-paste-begin");
+    paste_keys[4] = '1';
+    paste_end_key = yed_plugin_add_key_sequence(Self, 6, paste_keys);
+    YPBIND(Self, paste_end_key, "xul-paste-end");
+
+    /* Through yed's own output buffer, so it isn't interleaved with a frame. */
+    append_to_output_buff("\e[?2004h");
+    flush_output_buff();
+}
+
+void change_mode(int new_mode) {
+    TRACE_BEGIN("change_mode");
+
+    /*
+     * Bindings live in per-mode tries that _take_key() looks at, so
+     * nothing in the core keymap changes here.
+     */
+    visual   = 0;
+    seq_node = NULL;
+    seq_len  = 0;
+
+    switch (mode) {
+        case MODE_NORMAL:                      break;
+        case MODE_INSERT: exit_insert();       break;
+    }
+
+    mode = new_mode;
+
+    if (virt_line_sel && new_mode != MODE_NORMAL) {
+        /* Stop drawing the cursor line as selected. */
+        virt_line_sel = 0;
+        request_redraw();
+    }
+
+    switch (new_mode) {
+        case MODE_NORMAL: {
+            break;
+        }
+        case MODE_INSERT: enter_insert();        break;
+    }
+
+    if (macro_depth) {
+        /* Set once when the macro is done instead of on every mode switch. */
+        mode_vars_dirty = 1;
+    } else {
+        set_mode_vars();
+    }
+
+    TRACE_END("change_mode");
+}
+
+static void set_mode_vars(void) {
+    yed_set_var("xul-mode", mode_strs[mode]);
+
+    yed_set_var("xul-mode-attrs", yed_get_var("xul-insert-attrs"));
+
+    switch (mode) {
+        case MODE_NORMAL: yed_set_var("xul-mode-attrs", yed_get_var("xul-normal-attrs")); break;
+        case MODE_INSERT: yed_set_var("xul-mode-attrs", yed_get_var("xul-insert-attrs")); break;
+    }
+}
+
+static void request_redraw(void) {
+    if (macro_depth) {
+        redraw_dirty = 1;
+    } else {
+        ys->redraw = 1;
+    }
+}
+
+/*
+ * Buffers with xul-large-buffer-lines lines or more don't get the
+ * default cursor line selection as a yed selection, since every j/k
+ * would drop it and make it again.  The cursor line is only drawn as
+ * selected (see eline()), and a real selection is made from it when
+ * something is about to use it.
+ */
+static int large_buffer(yed_buffer *buff) {
+    char *s;
+    int   lines;
+
+    if (buff->flags & BUFF_SPECIAL)                              { return 0; }
+    if ((s = yed_get_var("xul-large-buffer-lines")) == NULL)     { return 0; }
+    if (sscanf(s, "%d", &lines) != 1 || lines <= 0)              { return 0; }
+
+    return yed_buff_n_lines(buff) >= lines;
+}
+
+/* The default selection of the cursor line in normal mode. */
+static void select_cursor_line(void) {
+    yed_frame *f;
+
+    f = ys->active_frame;
+
+    if (f && f->buffer && (macro_depth || large_buffer(f->buffer))) {
+        if (f->buffer->has_selection) {
+            XEXE(CMD_SELECT_OFF);
+        }
+        if (!virt_line_sel) {
+            request_redraw();
+        }
+        virt_line_sel = 1;
+        virt_row      = f->cursor_line;
+        return;
+    }
+
+    virt_line_sel = 0;
+    XEXE(CMD_SELECT_LINES);
+}
+
+/* Turn the cursor line drawn as selected into a real selection. */
+static void materialize_line_sel(void) {
+    yed_frame *f;
+
+    if (!virt_line_sel) { return; }
+
+    virt_line_sel = 0;
+    f             = ys->active_frame;
+
+    if (mode == MODE_NORMAL && f && f->buffer && !f->buffer->has_selection) {
+        XEXE(CMD_SELECT_LINES);
+    }
+}
+
+static unsigned trie_hash(trie_node *parent, int key) {
+    return ((unsigned)((uintptr_t)parent >> 4) * 2654435761u) ^ (key * 16777619u);
+}
+
+static trie_node *trie_child(trie_node *parent, int key) {
+    trie_node *node;
+
+    if (n_trie_nodes == 0) { return NULL; }
+
+    node = trie_table[trie_hash(parent, key) & (trie_table_size - 1)];
+
+    while (node != NULL) {
+        if (node->parent == parent && node->key == key) {
+            return node;
+        }
+        node = node->next;
+    }
+
+    return NULL;
+}
+
+static void grow_trie_table(void) {
+    trie_node **old_table;
+    int         old_size;
+    int         i;
+    trie_node  *node;
+    trie_node  *next;
+    trie_node **slot;
+
+    old_table = trie_table;
+    old_size  = trie_table_size;
+
+    trie_table_size = old_size ? 2 * old_size : 64;
+    trie_table      = calloc(trie_table_size, sizeof(trie_node*));
+
+    for (i = 0; i < old_size; i += 1) {
+        for (node = old_table[i]; node != NULL; node = next) {
+            next       = node->next;
+            slot       = &trie_table[trie_hash(node->parent, node->key) & (trie_table_size - 1)];
+            node->next = *slot;
+            *slot      = node;
+        }
+    }
+
+    free(old_table);
+}
+
+static trie_node *trie_add(int b_mode, int n_keys, int *keys) {
+    trie_node  *parent;
+    trie_node  *node;
+    trie_node **slot;
+    int         i;
+
+    parent = &trie_roots[b_mode];
+
+    for (i = 0; i < n_keys; i += 1, parent = node) {
+        if ((node = trie_child(parent, keys[i])) != NULL) { continue; }
+
+        if (n_trie_nodes >= trie_table_size) {
+            grow_trie_table();
+        }
+
+        node = calloc(1, sizeof(*node));
+
+        node->parent = parent;
+        node->key    = keys[i];
+        slot         = &trie_table[trie_hash(parent, keys[i]) & (trie_table_size - 1)];
+        node->next   = *slot;
+        *slot        = node;
+
+        parent->n_children += 1;
+        n_trie_nodes       += 1;
+    }
+
+    return parent;
+}
+
+/* Drop a node's binding and any nodes that no longer lead to one. */
+static void trie_remove(trie_node *node) {
+    trie_node  *parent;
+    trie_node **slot;
+
+    node->binding = NULL;
+
+    while (node->parent != NULL
+    &&     node->binding == NULL
+    &&     node->n_children == 0) {
+
+        parent = node->parent;
+
+        slot = &trie_table[trie_hash(parent, node->key) & (trie_table_size - 1)];
+        while (*slot != node) {
+            slot = &(*slot)->next;
+        }
+        *slot = node->next;
+
+        parent->n_children -= 1;
+        n_trie_nodes       -= 1;
+
+        if (seq_node == node) {
+            seq_node = NULL;
+            seq_len  = 0;
+        }
+
+        free(node);
+
+        node = parent;
+    }
+}
+
+void free_trie(void) {
+    int        i;
+    trie_node *node;
+    trie_node *next;
+
+    for (i = 0; i < trie_table_size; i += 1) {
+        for (node = trie_table[i]; node != NULL; node = next) {
+            next = node->next;
+            free(node);
+        }
+    }
+
+    free(trie_table);
+
+    trie_table      = NULL;
+    trie_table_size = 0;
+    n_trie_nodes    = 0;
+    seq_node        = NULL;
+    seq_len         = 0;
+}
+
+static void run_binding(key_binding *b) {
+    const char *name;
+    int         traced;
+
+    flush_insert();
+    stats_cmds += 1;
+
+    /* The command may unbind b (or turn tracing on or off). */
+    name   = NULL;
+    traced = trace_on;
+    if (traced) {
+        name = trace_name(b->cmd);
+        trace_add(name, 'B');
+    }
+
+    yed_execute_command(b->cmd, b->n_args, b->args);
+
+    if (traced && trace_on) {
+        trace_add(name, 'E');
+    }
+}
+
+static void take_builtin_key(int key) {
+    switch (mode) {
+        case MODE_NORMAL: normal(key); break;
+        case MODE_INSERT: insert(key); break;
+        default:
+            LOG_FN_ENTER();
+            yed_log("[!] invalid mode (?)");
+            LOG_EXIT();
+    }
+}
+
+/*
+ * Walk the current mode's binding trie one key at a time.  A key that
+ * ends on a leaf runs that binding.  A key that ends on an inner node
+ * waits for more keys, even if that node has a binding of its own.
+ * When a key doesn't continue the keys typed so far, or no key comes
+ * within xul-key-timeout milliseconds (see epump()), the longest bound
+ * prefix runs and the rest of the keys are fed through again; if no
+ * prefix is bound, the first key goes to the built-in handlers.
+ */
+static void flush_seq(void) {
+    trie_node *node;
+    int        keys[MAX_SEQ_LEN];
+    int        n_keys;
+    int        depth;
+    int        i;
+
+    node   = seq_node;
+    n_keys = seq_len;
+    memcpy(keys, seq_keys, n_keys * sizeof(int));
+
+    seq_node = NULL;
+    seq_len  = 0;
+
+    for (depth = n_keys; depth > 0 && node->binding == NULL; depth -= 1) {
+        node = node->parent;
+    }
+
+    if (depth > 0) {
+        run_binding(node->binding);
+    } else {
+        take_builtin_key(keys[0]);
+        depth = 1;
+    }
+
+    for (i = depth; i < n_keys; i += 1) {
+        _take_key(keys[i]);
+    }
+}
+
+static void _take_key(int key) {
+    trie_node *node;
+
+    TRACE_BEGIN("_take_key");
+
+    node = trie_child(seq_node ? seq_node : &trie_roots[mode], key);
+
+    if (node != NULL && seq_len < MAX_SEQ_LEN) {
+        if (node->n_children == 0) {
+            seq_node = NULL;
+            seq_len  = 0;
+            run_binding(node->binding);
+        } else {
+            seq_node           = node;
+            seq_keys[seq_len]  = key;
+            seq_len           += 1;
+            seq_time           = now_ns();
+        }
+        goto out;
+    }
+
+    if (seq_node == NULL) {
+        take_builtin_key(key);
+        goto out;
+    }
+
+    flush_seq();
+    _take_key(key);
+
+out:;
+    TRACE_END("_take_key");
+}
+
+/* Called from epump(): give up waiting for the rest of a key sequence. */
+static void seq_timeout(void) {
+    char *s;
+    long  ms;
+
+    s  = yed_get_var("xul-key-timeout");
+    ms = s ? strtol(s, NULL, 10) : 0;
+
+    if (ms <= 0 || now_ns() - seq_time < ms * 1000000ULL) { return; }
+
+    TRACE_BEGIN("seq_timeout");
+    flush_seq();
+    request_redraw();
+    TRACE_END("seq_timeout");
+}
+
+/* Keys from outside (yed or xul-take-key) come in here, so they can be recorded. */
+static void take_key(int key) {
+    unsigned long long start;
+    int                key_mode;
+
+    if (chunked.op) { return; }
+
+    if (macro_recording && !macro_depth) {
+        array_push(macro_regs[macro_recording - 1], key);
+    }
+
+    if (!stats_on) {
+        _take_key(key);
+        return;
+    }
+
+    key_mode   = mode;
+    stats_cmds = 0;
+    start      = now_ns();
+
+    _take_key(key);
+
+    record_key_stat(key_mode, key, now_ns() - start, stats_cmds);
+}
+
+/*
+ * Macros.  "qa" ... "q" records the keys typed into register a and
+ * "3@a" feeds them back through _take_key() three times ("@@" repeats
+ * the last register).  A bracketed paste is recorded as its text (see
+ * xul_paste_end()).  While a macro runs, mode variable updates, redraw
+ * requests, and the default cursor line selection (which is kept
+ * virtual, as in large buffers) are held back and done once at the
+ * end, so a long replay costs about what its edits cost.
+ */
+#define MAX_MACRO_DEPTH (16)
+#define MACRO_PASTE     (-1)
+
+/* Paste the text recorded at keys[j] (length, then bytes); returns its last index. */
+static int replay_paste(array_t *keys, int j) {
+    array_t text;
+    int     len;
+    int     i;
+    char    c;
+
+    len  = *(int*)array_item(*keys, j);
+    text = array_make(char);
+
+    for (i = 1; i <= len && j + i < array_len(*keys); i += 1) {
+        c = *(int*)array_item(*keys, j + i);
+        array_push(text, c);
+    }
+    array_zero_term(text);
+
+    paste_insert(array_data(text), array_len(text));
+
+    array_free(text);
+
+    return j + len;
+}
+
+static void replay_macro(int reg, int n) {
+    array_t *keys;
+    int      i;
+    int      j;
+    int      key;
+
+    if (macro_recording == reg + 1) {
+        yed_cerr("register '%c' is being recorded", 'a' + reg);
+        return;
+    }
+    if (macro_depth >= MAX_MACRO_DEPTH) {
+        yed_cerr("macros nested too deeply");
+        return;
+    }
+
+    keys       = &macro_regs[reg];
+    last_macro = reg + 1;
+
+    macro_depth += 1;
+    for (i = 0; i < n; i += 1) {
+        for (j = 0; j < array_len(*keys); j += 1) {
+            key = *(int*)array_item(*keys, j);
+            if (key == MACRO_PASTE) {
+                j = replay_paste(keys, j + 1);
+            } else {
+                _take_key(key);
+            }
+        }
+    }
+    macro_depth -= 1;
+
+    if (macro_depth == 0) {
+        if (virt_line_sel
+        &&  ys->active_frame
+        &&  ys->active_frame->buffer
+        &&  !large_buffer(ys->active_frame->buffer)) {
+            materialize_line_sel();
+        }
+        if (mode_vars_dirty) {
+            set_mode_vars();
+            mode_vars_dirty = 0;
+        }
+        if (redraw_dirty) {
+            ys->redraw   = 1;
+            redraw_dirty = 0;
+        }
+    }
+}
+
+/* The register key after 'q' or '@'. */
+static void macro_key(int pending, int key, int n) {
+    int  reg;
+    char name[2];
+
+    if (pending == '@' && key == '@' && last_macro) {
+        reg = last_macro - 1;
+    } else if (key >= 'a' && key <= 'z') {
+        reg = key - 'a';
+    } else {
+        if (key != ESC && key != CTRL_C) {
+            yed_cerr("no register '%c'", key);
+        }
+        return;
+    }
+
+    if (pending == '@') {
+        replay_macro(reg, n);
+        return;
+    }
+
+    array_clear(macro_regs[reg]);
+    macro_recording = reg + 1;
+
+    name[0] = key;
+    name[1] = 0;
+    yed_set_var("xul-recording", name);
+}
+
+/* Decimal strings for keys that are passed to commands, made on first use. */
+static char *key_string(int key) {
+    static char strs[REAL_KEY_MAX][8];
+
+    if (key <= 0 || key >= REAL_KEY_MAX) { return "0"; }
+
+    if (strs[key][0] == 0) {
+        snprintf(strs[key], sizeof(strs[key]), "%d", key);
+    }
+
+    return strs[key];
+}
+
+void xul_take_key(int n_args, char **args) {
+    int key;
+
+    if (n_args != 1) {
+        yed_cerr("expected 1 argument, but got %d", n_args);
+        return;
+    }
+
+    if (sscanf(args[0], "%d", &key) != 1) {
+        yed_cerr("expected integer, but got '%s'", args[0]);
+        return;
+    }
+
+    take_key(key);
+}
+
+void xul_bind(int n_args, char **args) {
+    char *mode_str, *cmd;
+    int   b_mode, n_keys, keys[MAX_SEQ_LEN], n_cmd_args;
+
+    if (n_args < 1) {
+        yed_cerr("missing 'mode' as first argument");
+        return;
+    }
+
+    mode_str = args[0];
+
+    if      (strcmp(mode_str, "normal") == 0)    { b_mode = MODE_NORMAL; }
+    else if (strcmp(mode_str, "insert") == 0)    { b_mode = MODE_INSERT; }
+    else {
+        yed_cerr("no mode named '%s'", mode_str);
+        return;
+    }
+
+    if (n_args < 2) {
+        yed_cerr("missing 'keys' as second argument");
+        return;
+    }
+
+    if (n_args < 3) {
+        yed_cerr("missing 'command', 'command_args'... as third and up arguments");
+        return;
+    }
+
+    n_keys = yed_string_to_keys(args[1], keys);
+    if (n_keys == -1) {
+        yed_cerr("invalid string of keys '%s'", args[1]);
+        return;
+    }
+    if (n_keys == -2) {
+        yed_cerr("too many keys to be a sequence in '%s'", args[1]);
+        return;
+    }
+
+    cmd = args[2];
+
+    n_cmd_args = n_args - 3;
+    make_binding(b_mode, n_keys, keys, cmd, n_cmd_args, args + 3);
+}
+
+void xul_unbind(int n_args, char **args) {
+    char *mode_str;
+    int   b_mode, n_keys, keys[MAX_SEQ_LEN];
+
+    if (n_args < 1) {
+        yed_cerr("missing 'mode' as first argument");
+        return;
+    }
+
+    mode_str = args[0];
+
+    if      (strcmp(mode_str, "normal") == 0)    { b_mode = MODE_NORMAL; }
+    else if (strcmp(mode_str, "insert") == 0)    { b_mode = MODE_INSERT; }
+    else {
+        yed_cerr("no mode named '%s'", mode_str);
+        return;
+    }
+
+    if (n_args != 2) {
+        yed_cerr("missing 'keys' as second argument");
+        return;
+    }
+
+    n_keys = yed_string_to_keys(args[1], keys);
+    if (n_keys == -1) {
+        yed_cerr("invalid string of keys '%s'", args[1]);
+        return;
+    }
+    if (n_keys == -2) {
+        yed_cerr("too many keys to be a sequence in '%s'", args[1]);
+        return;
+    }
+
+    remove_binding(b_mode, n_keys, keys);
+}
+
+void free_binding(key_binding *b) {
+    int i;
+
+    if (b->args) {
+        for (i = 0; i < b->n_args; i += 1) {
+            free(b->args[i]);
+        }
+        free(b->args);
+    }
+    free(b->cmd);
+    free(b);
+}
+
+static unsigned binding_hash(int b_mode, int n_keys, int *keys) {
+    unsigned h;
+    int      i;
+
+    h = 2166136261u ^ b_mode;
+    for (i = 0; i < n_keys; i += 1) {
+        h ^= keys[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+/* Returns the link that points at the binding for these keys, or at NULL. */
+static key_binding **binding_slot(int b_mode, int n_keys, int *keys) {
+    key_binding **slot;
+
+    slot = &binding_table[binding_hash(b_mode, n_keys, keys) & (binding_table_size - 1)];
+
+    while (*slot != NULL) {
+        if ((*slot)->mode == b_mode
+        &&  (*slot)->len  == n_keys
+        &&  memcmp((*slot)->keys, keys, n_keys * sizeof(int)) == 0) {
+            break;
+        }
+        slot = &(*slot)->next;
+    }
+
+    return slot;
+}
+
+static void grow_binding_table(void) {
+    key_binding **old_table;
+    int           old_size;
+    int           i;
+    key_binding  *b;
+    key_binding  *next;
+    key_binding **slot;
+
+    old_table = binding_table;
+    old_size  = binding_table_size;
+
+    binding_table_size = old_size ? 2 * old_size : 64;
+    binding_table      = calloc(binding_table_size, sizeof(key_binding*));
+
+    for (i = 0; i < old_size; i += 1) {
+        for (b = old_table[i]; b != NULL; b = next) {
+            next    = b->next;
+            slot    = &binding_table[binding_hash(b->mode, b->len, b->keys) & (binding_table_size - 1)];
+            b->next = *slot;
+            *slot   = b;
+        }
+    }
+
+    free(old_table);
+}
+
+void make_binding(int b_mode, int n_keys, int *keys, char *cmd, int n_args, char **args) {
+    int           i;
+    key_binding  *b;
+    key_binding **slot;
+
+    if (n_keys <= 0) {
+        return;
+    }
+
+    if (n_keys == 1 && (keys[0] <= KEY_NULL || keys[0] >= REAL_KEY_MAX)) {
+        /* Only real keys come to xul-take-key, so the trie never sees the others. */
+        yed_cerr("can't bind key %d: xul only binds keys 1 to %d", keys[0], REAL_KEY_MAX - 1);
+        return;
+    }
+
+    /* A new binding for the same keys replaces the old one. */
+    remove_binding(b_mode, n_keys, keys);
+
+    if (n_bindings >= binding_table_size) {
+        grow_binding_table();
+    }
+
+    b = malloc(sizeof(*b));
+
+    b->len = n_keys;
+    for (i = 0; i < n_keys; i += 1) {
+        b->keys[i] = keys[i];
+    }
+    b->cmd    = strdup(cmd);
+    b->n_args = n_args;
+    if (n_args) {
+        b->args = malloc(sizeof(char*) * n_args);
+        for (i = 0; i < n_args; i += 1) {
+            b->args[i] = strdup(args[i]);
+        }
+    } else {
+        b->args = NULL;
+    }
+
+    b->node          = trie_add(b_mode, n_keys, keys);
+    b->node->binding = b;
+
+    b->mode = b_mode;
+    b->idx  = array_len(mode_bindings[b_mode]);
+    array_push(mode_bindings[b_mode], b);
+
+    slot        = binding_slot(b_mode, n_keys, keys);
+    b->next     = NULL;
+    *slot       = b;
+    n_bindings += 1;
+}
+
+void remove_binding(int b_mode, int n_keys, int *keys) {
+    key_binding **slot;
+    key_binding  *b;
+    key_binding  *last;
+
+    if (n_keys <= 0 || n_bindings == 0) {
+        return;
+    }
+
+    slot = binding_slot(b_mode, n_keys, keys);
+    b    = *slot;
+
+    if (b == NULL) { return; }
+
+    *slot       = b->next;
+    n_bindings -= 1;
+
+    trie_remove(b->node);
+
+    /* Swap the last binding into this one's place. */
+    last = *(key_binding**)array_last(mode_bindings[b_mode]);
+    if (last != b) {
+        last->idx = b->idx;
+        *(key_binding**)array_item(mode_bindings[b_mode], b->idx) = last;
+    }
+    array_pop(mode_bindings[b_mode]);
+
+    free_binding(b);
+}
+
+void xul_exit_insert(int n_args, char **args) {
+    change_mode(MODE_NORMAL);
+}
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+#ifdef XUL_BENCH
+/*
+ * Compare the cost of "select-off" + "select-lines" (what every 'j'
+ * does) run by name through yed_execute_command() against the
+ * same pair run through the resolved handles.  Only built for
+ * bench/ (./build.sh bench defines XUL_BENCH).
+ */
+void xul_bench_dispatch(int n_args, char **args) {
+    int                i;
+    int                n;
+    unsigned long long start;
+    unsigned long long by_name;
+    unsigned long long by_handle;
+
+    if (n_args > 1) {
+        yed_cerr("expected 0 or 1 arguments, but got %d", n_args);
+        return;
+    }
+
+    n = 100000;
+    if (n_args == 1 && sscanf(args[0], "%d", &n) != 1) {
+        yed_cerr("expected integer, but got '%s'", args[0]);
+        return;
+    }
+    if (n <= 0) { return; }
+
+    if (!ys->active_frame || !ys->active_frame->buffer) {
+        yed_cerr("no active buffer");
+        return;
+    }
+
+    start = now_ns();
+    for (i = 0; i < n; i += 1) {
+        YEXE("select-off");
+        YEXE("select-lines");
+    }
+    by_name = now_ns() - start;
+
+    start = now_ns();
+    for (i = 0; i < n; i += 1) {
+        XEXE(CMD_SELECT_OFF);
+        XEXE(CMD_SELECT_LINES);
+    }
+    by_handle = now_ns() - start;
+
+    yed_cprint("by name: %.1fns/command, by handle: %.1fns/command",
+               (double)by_name   / (2.0 * n),
+               (double)by_handle / (2.0 * n));
+}
+#endif
+
+/*
+ * Key latency statistics.  With "xul-stats on", every key that comes
+ * in is timed and counted per mode and key in a histogram with one
+ * bucket per power of two nanoseconds, along with how many commands
+ * it ran.  "xul-stats" shows p50/p99/max per key in *xul-stats,
+ * "xul-stats dump <file>" writes the same report to a file.
+ * When off, the cost is one branch per key.
+ */
+#define STAT_BUCKETS (40)
+
+typedef struct {
+    int                key_mode;
+    int                key;
+    unsigned long long n;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    unsigned long long n_cmds;
+    unsigned           buckets[STAT_BUCKETS]; /* bucket b: [2^(b-1), 2^b) ns */
+} key_stat;
+
+static key_stat *key_stats[N_MODES][REAL_KEY_MAX];
+
+static void record_key_stat(int key_mode, int key, unsigned long long ns, unsigned n_cmds) {
+    key_stat *st;
+    int       b;
+
+    if (key < 0 || key >= REAL_KEY_MAX) { return; }
+
+    if ((st = key_stats[key_mode][key]) == NULL) {
+        st = key_stats[key_mode][key] = calloc(1, sizeof(key_stat));
+        st->key_mode = key_mode;
+        st->key      = key;
+    }
+
+    b = ns ? 64 - __builtin_clzll(ns) : 0;
+    if (b >= STAT_BUCKETS) { b = STAT_BUCKETS - 1; }
+
+    st->n          += 1;
+    st->total_ns   += ns;
+    st->n_cmds     += n_cmds;
+    st->buckets[b] += 1;
+    if (ns > st->max_ns) { st->max_ns = ns; }
+}
+
+void free_stats(void) {
+    int m;
+    int k;
+
+    for (m = 0; m < N_MODES; m += 1) {
+        for (k = 0; k < REAL_KEY_MAX; k += 1) {
+            free(key_stats[m][k]);
+            key_stats[m][k] = NULL;
+        }
+    }
+}
+
+/* Upper bound of the bucket that holds the pth percentile. */
+static unsigned long long stat_percentile(key_stat *st, int p) {
+    unsigned long long want;
+    unsigned long long seen;
+    int                b;
+
+    want = (st->n * p + 99) / 100;
+    seen = 0;
+
+    for (b = 0; b < STAT_BUCKETS; b += 1) {
+        seen += st->buckets[b];
+        if (seen >= want) { break; }
+    }
+
+    return 1ULL << b;
+}
+
+static void fmt_ns(char *buff, int size, unsigned long long ns) {
+    if      (ns < 1000ULL)       { snprintf(buff, size, "%lluns",  ns);                  }
+    else if (ns < 1000000ULL)    { snprintf(buff, size, "%.1fus", ns / 1000.0);       }
+    else if (ns < 1000000000ULL) { snprintf(buff, size, "%.1fms", ns / 1000000.0);    }
+    else                         { snprintf(buff, size, "%.2fs",  ns / 1000000000.0); }
+}
+
+static void fmt_key(char *buff, int size, int key) {
+    switch (key) {
+        case ENTER:     snprintf(buff, size, "ENTER");     return;
+        case TAB:       snprintf(buff, size, "TAB");       return;
+        case ESC:       snprintf(buff, size, "ESC");       return;
+        case BACKSPACE: snprintf(buff, size, "BACKSPACE"); return;
+        case MBYTE:     snprintf(buff, size, "MBYTE");     return;
+    }
+
+    if (key < 32)       { snprintf(buff, size, "CTRL_%c", '@' + key); }
+    else if (key < 127) { snprintf(buff, size, "%c", key);            }
+    else                { snprintf(buff, size, "<%d>", key);          }
+}
+
+static int cmp_stat_total(const void *a, const void *b) {
+    const key_stat *sa;
+    const key_stat *sb;
+
+    sa = *(const key_stat**)a;
+    sb = *(const key_stat**)b;
+
+    if (sa->total_ns == sb->total_ns) { return 0; }
+    return sa->total_ns < sb->total_ns ? 1 : -1;
+}
+
+/* The report as one string, slowest keys (by total time) first. */
+static char *stats_report(void) {
+    array_t    text;
+    array_t    sorted;
+    key_stat **it;
+    key_stat  *st;
+    char       line[256];
+    char       k[32];
+    char       p50[32];
+    char       p99[32];
+    char       max[32];
+    int        m;
+    int        i;
+
+    text   = array_make(char);
+    sorted = array_make(key_stat*);
+
+    for (m = 0; m < N_MODES; m += 1) {
+        for (i = 0; i < REAL_KEY_MAX; i += 1) {
+            if ((st = key_stats[m][i]) != NULL) {
+                array_push(sorted, st);
+            }
+        }
+    }
+
+    qsort(array_data(sorted), array_len(sorted), sizeof(key_stat*), cmp_stat_total);
+
+    snprintf(line, sizeof(line), "%-8s %-10s %10s %10s %10s %10s %10s\n",
+             "MODE", "KEY", "COUNT", "P50", "P99", "MAX", "CMDS/KEY");
+    array_push_n(text, line, strlen(line));
+
+    array_traverse(sorted, it) {
+        st = *it;
+        fmt_key(k, sizeof(k), st->key);
+        fmt_ns(p50, sizeof(p50), stat_percentile(st, 50));
+        fmt_ns(p99, sizeof(p99), stat_percentile(st, 99));
+        fmt_ns(max, sizeof(max), st->max_ns);
+        snprintf(line, sizeof(line), "%-8s %-10s %10llu %10s %10s %10s %10.1f\n",
+                 mode_strs[st->key_mode], k, st->n, p50, p99, max,
+                 (double)st->n_cmds / st->n);
+        array_push_n(text, line, strlen(line));
+    }
+
+    array_free(sorted);
+
+    array_zero_term(text);
+
+    return array_data(text);
+}
+
+void xul_stats(int n_args, char **args) {
+    yed_buffer *buff;
+    char       *report;
+    FILE       *f;
+
+    if (n_args == 1 && strcmp(args[0], "on") == 0) {
+        stats_on = 1;
+        return;
+    }
+    if (n_args == 1 && strcmp(args[0], "off") == 0) {
+        stats_on = 0;
+        return;
+    }
+    if (n_args == 1 && strcmp(args[0], "reset") == 0) {
+        free_stats();
+        return;
+    }
+
+    if (n_args == 2 && strcmp(args[0], "dump") == 0) {
+        if ((f = fopen(args[1], "w")) == NULL) {
+            yed_cerr("could not open '%s'", args[1]);
+            return;
+        }
+        report = stats_report();
+        fputs(report, f);
+        fclose(f);
+        free(report);
+        yed_cprint("wrote key stats to '%s'", args[1]);
+        return;
+    }
+
+    if (n_args != 0) {
+        yed_cerr("usage: xul-stats [on|off|reset|dump <file>]");
+        return;
+    }
+
+    buff = yed_get_or_create_special_rdonly_buffer("*xul-stats");
+    report = stats_report();
+
+    buff->flags &= ~BUFF_RD_ONLY;
+    yed_buff_clear_no_undo(buff);
+    yed_buff_insert_string_no_undo(buff, report, 1, 1);
+    buff->flags |= BUFF_RD_ONLY;
+
+    free(report);
+
+    YEXE_COUNTED("special-buffer-prepare-focus", "*xul-stats");
+    YEXE_COUNTED("buffer", "*xul-stats");
+}
+
+static void trace_add(const char *name, char ph) {
+    trace_event *ev;
+
+    ev       = &trace_ring[trace_head];
+    ev->ts   = now_ns();
+    ev->name = name;
+    ev->ph   = ph;
+
+    trace_head = (trace_head + 1) % trace_cap;
+    if (trace_len < trace_cap) { trace_len += 1; }
+}
+
+/*
+ * The ring keeps name pointers, and a binding's command is freed when
+ * it is unbound, so bindings are traced under a copy of the name that
+ * lasts until unload.
+ */
+static const char *trace_name(const char *name) {
+    char **it;
+    char  *copy;
+
+    array_traverse(trace_names, it) {
+        if (strcmp(*it, name) == 0) { return *it; }
+    }
+
+    copy = strdup(name);
+    array_push(trace_names, copy);
+
+    return copy;
+}
+
+static int trace_dump(const char *path) {
+    FILE        *f;
+    trace_event *ev;
+    int          i;
+    int          depth;
+    int          first;
+
+    if ((f = fopen(path, "w")) == NULL) { return 0; }
+
+    fprintf(f, "{\"traceEvents\":[\n");
+
+    depth = 0;
+    first = 1;
+
+    for (i = 0; i < trace_len; i += 1) {
+        ev = &trace_ring[(trace_head - trace_len + i + trace_cap) % trace_cap];
+
+        /* Ends whose begin fell out of the ring. */
+        if (ev->ph == 'E') {
+            if (depth == 0) { continue; }
+            depth -= 1;
+        } else {
+            depth += 1;
+        }
+
+        fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":1}",
+                first ? "" : ",\n",
+                ev->name, ev->ph,
+                (ev->ts - trace_start) / 1000.0);
+        first = 0;
+    }
+
+    fprintf(f, "\n]}\n");
+    fclose(f);
+
+    return 1;
+}
+
+void xul_trace(int n_args, char **args) {
+    long         cap;
+    char        *end;
+    trace_event *ring;
+
+    if (n_args >= 1 && strcmp(args[0], "on") == 0) {
+        cap = 1 << 20;
+        if (n_args == 2) {
+            errno = 0;
+            cap   = strtol(args[1], &end, 10);
+            if (errno || end == args[1] || *end || cap <= 0 || cap > INT_MAX) {
+                yed_cerr("expected a positive integer, but got '%s'", args[1]);
+                return;
+            }
+        }
+
+        if ((ring = malloc((size_t)cap * sizeof(trace_event))) == NULL) {
+            yed_cerr("could not allocate %ld trace events", cap);
+            return;
+        }
+
+        free(trace_ring);
+        trace_ring  = ring;
+        trace_cap   = cap;
+        trace_head  = 0;
+        trace_len   = 0;
+        trace_start = now_ns();
+        trace_on    = 1;
+        return;
+    }
+
+    if (n_args == 1 && strcmp(args[0], "off") == 0) {
+        trace_on = 0;
+        return;
+    }
+
+    if (n_args == 2 && strcmp(args[0], "dump") == 0) {
+        if (trace_ring == NULL) {
+            yed_cerr("nothing traced");
+            return;
+        }
+        if (!trace_dump(args[1])) {
+            yed_cerr("could not open '%s'", args[1]);
+            return;
+        }
+        yed_cprint("wrote %d trace events to '%s'", trace_len, args[1]);
+        return;
+    }
+
+    yed_cerr("usage: xul-trace on [events] | off | dump <file>");
+}
+
+void xul_paste_begin(int n_args, char **args) {
+    pasting = 1;
+    array_clear(paste_text);
+}
+
+/* Insert text (zero terminated, len bytes) at the cursor as one edit. */
+static void paste_insert(char *text, int len) {
+    yed_frame  *frame;
+    yed_buffer *buff;
+    yed_line   *line;
+    char       *last_nl;
+    int         row;
+    int         idx;
+
+    frame = ys->active_frame;
+
+    if (len == 0 || frame == NULL || frame->buffer == NULL) { return; }
+
+    buff = frame->buffer;
+
+    if (buff->flags & BUFF_RD_ONLY) { return; }
+
+    flush_insert();
+
+    row  = frame->cursor_line;
+    line = yed_buff_get_line(buff, row);
+    idx  = line ? yed_line_col_to_idx(line, frame->cursor_col) : 0;
+
+    if (mode == MODE_NORMAL) {
+        visual = 0;
+        XEXE(CMD_SELECT_OFF);
+    }
+
+    yed_start_undo_record(frame, buff);
+    yed_buff_insert_string(buff, text, row, frame->cursor_col);
+    yed_end_undo_record(frame, buff);
+
+    /* Put the cursor right after the pasted text. */
+    for (last_nl = text; (last_nl = strchr(last_nl, '\n')) != NULL; last_nl += 1) {
+        row += 1;
+        idx  = -(last_nl + 1 - text);
+    }
+    idx += len;
+
+    line = yed_buff_get_line(buff, row);
+    if (line) {
+        yed_set_cursor_within_frame(frame, row, yed_line_idx_to_col(line, idx));
+    }
+
+    if (mode == MODE_NORMAL) {
+        select_cursor_line();
+    }
+}
+
+void xul_paste_end(int n_args, char **args) {
+    int len;
+    int i;
+    int key;
+
+    if (!pasting) { return; }
+
+    pasting = 0;
+    len     = array_len(paste_text);
+
+    if (len == 0) { return; }
+
+    array_zero_term(paste_text);
+
+    /* A macro keeps the paste as MACRO_PASTE, the length, and the bytes. */
+    if (macro_recording && !macro_depth) {
+        key = MACRO_PASTE;
+        array_push(macro_regs[macro_recording - 1], key);
+        array_push(macro_regs[macro_recording - 1], len);
+        for (i = 0; i < len; i += 1) {
+            key = ((unsigned char*)array_data(paste_text))[i];
+            array_push(macro_regs[macro_recording - 1], key);
+        }
+    }
+
+    paste_insert(array_data(paste_text), len);
+
+    array_clear(paste_text);
+}
+
+static void move_cursor_lines(int delta) {
+    yed_frame *f;
+    int        row;
+    int        n_lines;
+
+    if (!ys->active_frame || !ys->active_frame->buffer)    { return; }
+
+    f       = ys->active_frame;
+    n_lines = yed_buff_n_lines(f->buffer);
+    row     = f->cursor_line + delta;
+
+    if (row > n_lines) { row = n_lines; }
+    if (row < 1)       { row = 1;       }
+
+    if (row != f->cursor_line) {
+        yed_set_cursor_within_frame(f, row, f->cursor_col);
+    }
+}
+
+static void move_cursor_cols(int delta) {
+    yed_frame *f;
+    yed_line  *line;
+    int        col;
+    yed_glyph *g;
+
+    if (!ys->active_frame || !ys->active_frame->buffer)    { return; }
+
+    f = ys->active_frame;
+
+    line = yed_buff_get_line(f->buffer, f->cursor_line);
+
+    if (!line)    { return; }
+
+    col = f->cursor_col;
+
+    for (; delta > 0; delta -= 1) {
+        if (col > line->visual_width) { break; }
+        g    = yed_line_col_to_glyph(line, col);
+        col += yed_get_glyph_width(g);
+    }
+    for (; delta < 0 && col > 1; delta += 1) {
+        col = yed_line_idx_to_col(line, yed_line_col_to_idx(line, col - 1));
+    }
+
+    if (col != f->cursor_col) {
+        yed_set_cursor_within_frame(f, f->cursor_line, col);
+    }
+}
+
+/*
+ * Set up the bytes to search for when looking for key in a line:
+ * a single byte for ASCII keys, or the glyph that came in with MBYTE.
+ * UTF-8 is self-synchronizing, so a byte match of a whole encoded
+ * glyph always starts on a glyph boundary.
+ */
+static int till_target(int key, char *bytes) {
+    int len;
+
+    if (key == MBYTE) {
+        len = yed_get_glyph_len(&ys->mbyte);
+        memcpy(bytes, ys->mbyte.bytes, len);
+        return len;
+    }
+
+    if (key <= KEY_NULL || key >= 128) { return 0; }
+
+    bytes[0] = key;
+
+    return 1;
+}
+
+static int find_fw(const char *data, int start, int end, const char *t, int t_len) {
+    const char *p;
+
+    while (start + t_len <= end) {
+        p = memchr(data + start, t[0], end - start - t_len + 1);
+        if (p == NULL) { break; }
+        if (t_len == 1 || memcmp(p, t, t_len) == 0) {
+            return p - data;
+        }
+        start = (p - data) + 1;
+    }
+
+    return -1;
+}
+
+static int find_bw(const char *data, int end, const char *t, int t_len) {
+    int i;
+
+#ifdef __GLIBC__
+    const char *p;
+
+    if (t_len == 1) {
+        p = memrchr(data, t[0], end);
+        return p == NULL ? -1 : p - data;
+    }
+#endif
+
+    for (i = end - t_len; i >= 0; i -= 1) {
+        if (data[i] == t[0]
+        &&  (t_len == 1 || memcmp(data + i, t, t_len) == 0)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void do_till_fw(int key) {
+    yed_frame *f;
+    yed_line  *line;
+    char       t[4];
+    int        t_len;
+    char      *data;
+    int        len;
+    int        idx;
+    int        hit;
+    int        target_idx;
+    int        n;
+
+    if (!ys->active_frame || !ys->active_frame->buffer)    { goto out; }
+
+    f = ys->active_frame;
+
+    line = yed_buff_get_line(f->buffer, f->cursor_line);
+
+    if (!line)                                   { goto out; }
+    if ((t_len = till_target(key, t)) == 0)      { goto out; }
+    if (f->cursor_col > line->visual_width)      { goto record; }
+
+    data = array_data(line->glyphs);
+    len  = array_len(line->glyphs);
+    idx  = yed_line_col_to_idx(line, f->cursor_col);
+    idx += yed_get_glyph_len(yed_line_col_to_glyph(line, f->cursor_col));
+
+    target_idx = -1;
+
+    for (n = till_count; n > 0; n -= 1) {
+        hit = find_fw(data, idx, len, t, t_len);
+        if (hit < 0) { break; }
+        target_idx = hit;
+        idx        = hit + t_len;
+    }
+
+    if (target_idx >= 0) {
+        yed_set_cursor_within_frame(f, f->cursor_line, yed_line_idx_to_col(line, target_idx));
+    }
+
+record:;
+    last_till_key = key;
+    last_till_len = t_len;
+    memcpy(last_till_bytes, t, t_len);
+
+out:
+    till_pending = 0;
+    till_count   = 0;
+    return;
+}
+
+static void do_till_bw(int key, int stop_before) {
+    yed_frame *f;
+    yed_line  *line;
+    char       t[4];
+    int        t_len;
+    char      *data;
+    int        idx;
+    int        hit;
+    int        target_idx;
+    int        n;
+    int        col;
+
+    if (!ys->active_frame || !ys->active_frame->buffer)    { goto out; }
+
+    f = ys->active_frame;
+
+    line = yed_buff_get_line(f->buffer, f->cursor_line);
+
+    if (!line)                                   { goto out; }
+    if ((t_len = till_target(key, t)) == 0)      { goto out; }
+
+    data = array_data(line->glyphs);
+    idx  = f->cursor_col > line->visual_width
+            ? array_len(line->glyphs)
+            : yed_line_col_to_idx(line, f->cursor_col);
+
+    target_idx = -1;
+
+    for (n = till_count; n > 0; n -= 1) {
+        hit = find_bw(data, idx, t, t_len);
+        if (hit < 0) { break; }
+        target_idx = hit;
+        idx        = hit;
+    }
+
+    if (target_idx >= 0) {
+        col = yed_line_idx_to_col(line, target_idx);
+        if (stop_before) {
+            col += yed_get_glyph_width(yed_line_col_to_glyph(line, col));
+        }
+        yed_set_cursor_within_frame(f, f->cursor_line, col);
+    }
+
+    last_till_key = key;
+    last_till_len = t_len;
+    memcpy(last_till_bytes, t, t_len);
+
+out:
+    till_pending = 0;
+    till_count   = 0;
+    return;
+}
+
+static void build_till_index(yed_buffer *buff, int row, yed_line *line) {
+    char      *data;
+    int        len;
+    int        idx;
+    int        col;
+    int        start;
+    int        hit;
+    yed_glyph *g;
+    till_hit   h;
+
+    if (till_idx.valid
+    &&  till_idx.buffer     == buff
+    &&  till_idx.row        == row
+    &&  till_idx.target_len == last_till_len
+    &&  memcmp(till_idx.target, last_till_bytes, last_till_len) == 0) {
+        return;
+    }
+
+    till_idx.buffer     = buff;
+    till_idx.row        = row;
+    till_idx.target_len = last_till_len;
+    memcpy(till_idx.target, last_till_bytes, last_till_len);
+    till_idx.valid      = 1;
+    till_idx.pos        = -1;
+    array_clear(till_idx.hits);
+
+    data  = array_data(line->glyphs);
+    len   = array_len(line->glyphs);
+    idx   = 0;
+    col   = 1;
+    start = 0;
+
+    while ((hit = find_fw(data, start, len, last_till_bytes, last_till_len)) >= 0) {
+        while (idx < hit) {
+            g    = (yed_glyph*)(data + idx);
+            col += yed_get_glyph_width(g);
+            idx += yed_get_glyph_len(g);
+        }
+
+        h.idx   = hit;
+        h.col   = col;
+        h.width = yed_get_glyph_width((yed_glyph*)(data + hit));
+        array_push(till_idx.hits, h);
+
+        start = hit + last_till_len;
+    }
+}
+
+/*
+ * ';' (reverse = 0) and ',' (reverse = 1): go to the nth next
+ * occurrence of the last f/t/F/T target in the same or the opposite
+ * direction.
+ */
+static void do_till_repeat(int reverse, int n) {
+    yed_frame *f;
+    yed_line  *line;
+    int        forward;
+    int        stop_before;
+    int        cur;
+    int        k;
+    int        lo;
+    int        hi;
+    int        mid;
+    int        i;
+    till_hit  *h;
+
+    if (last_till_op == 0 || last_till_len == 0)           { return; }
+    if (!ys->active_frame || !ys->active_frame->buffer)    { return; }
+
+    f = ys->active_frame;
+
+    line = yed_buff_get_line(f->buffer, f->cursor_line);
+
+    if (!line) { return; }
+
+    build_till_index(f->buffer, f->cursor_line, line);
+
+    forward     = (last_till_op == 'f' || last_till_op == 't') != reverse;
+    stop_before = !forward && (last_till_op == 't' || last_till_op == 'T');
+    cur         = f->cursor_col;
+    k           = array_len(till_idx.hits);
+
+#define LANDING(_i) (((till_hit*)array_item(till_idx.hits, (_i)))->col \
+                    + (stop_before ? ((till_hit*)array_item(till_idx.hits, (_i)))->width : 0))
+
+    if (till_idx.pos >= 0 && till_idx.pos < k && LANDING(till_idx.pos) == cur) {
+        /* Still where the last repeat left us. */
+        i = till_idx.pos + (forward ? 1 : -1);
+    } else if (forward) {
+        /* First hit to the right of the cursor. */
+        lo = 0; hi = k;
+        while (lo < hi) {
+            mid = lo + ((hi - lo) / 2);
+            if (LANDING(mid) > cur) { hi = mid;     }
+            else                    { lo = mid + 1; }
+        }
+        i = lo;
+    } else {
+        /* Last hit to the left of the cursor. */
+        lo = 0; hi = k;
+        while (lo < hi) {
+            mid = lo + ((hi - lo) / 2);
+            if (LANDING(mid) < cur) { lo = mid + 1; }
+            else                    { hi = mid;     }
+        }
+        i = lo - 1;
+    }
+
+    if (i < 0 || i >= k) { goto out; }
+
+    i += (forward ? 1 : -1) * (n - 1);
+
+    if (i >= k) { i = k - 1; }
+    if (i <  0) { i = 0;     }
+
+    if (forward ? LANDING(i) > cur : LANDING(i) < cur) {
+        h            = array_item(till_idx.hits, i);
+        till_idx.pos = i;
+        yed_set_cursor_within_frame(f, f->cursor_line, h->col + (stop_before ? h->width : 0));
+    }
+
+out:;
+#undef LANDING
+}
+
+/*
+ * Search match index.  Each buffer keeps the positions of every match
+ * of the current search, built once per pattern and then kept up to
+ * date one line at a time like the bracket index, so n and N are
+ * binary searches instead of a fresh scan from the cursor.
+ * Matches never span lines.
+ */
+static int match_lower_bound(buffer_cache *cache, int row, int col) {
+    search_match *m;
+    int           lo;
+    int           hi;
+    int           mid;
+
+    m  = array_data(cache->matches);
+    lo = 0;
+    hi = array_len(cache->matches);
+
+    while (lo < hi) {
+        mid = lo + ((hi - lo) / 2);
+        if (m[mid].row < row || (m[mid].row == row && m[mid].col < col)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static void scan_line_matches(buffer_cache *cache, int row, int i) {
+    yed_line     *line;
+    const char   *data;
+    int           len;
+    int           t_len;
+    int           idx;
+    search_match  m;
+
+    line  = yed_buff_get_line(cache->buffer, row);
+    t_len = strlen(cache->search);
+
+    if (line == NULL || t_len == 0) { return; }
+
+    data  = array_data(line->glyphs);
+    len   = array_len(line->glyphs);
+    m.row = row;
+
+    for (idx = 0; (idx = find_fw(data, idx, len, cache->search, t_len)) >= 0; idx += t_len) {
+        m.col     = yed_line_idx_to_col(line, idx);
+        m.end_col = idx + t_len < len ? yed_line_idx_to_col(line, idx + t_len) : line->visual_width + 1;
+        array_insert(cache->matches, i, m);
+        i += 1;
+    }
+}
+
+static void update_search_index(buffer_cache *cache, yed_event *event) {
+    search_match *m;
+    int           row;
+    int           i;
+    int           n;
+
+    if (cache->search == NULL) { return; }
+
+    if (event->buff_mod_event == BUFF_MOD_CLEAR) {
+        free(cache->search);
+        cache->search = NULL;
+        return;
+    }
+
+    row = event->row;
+    i   = match_lower_bound(cache, row, 0);
+
+    if (event->buff_mod_event != BUFF_MOD_INSERT_LINE
+    &&  event->buff_mod_event != BUFF_MOD_ADD_LINE) {
+        while (i < array_len(cache->matches)
+        &&     ((search_match*)array_item(cache->matches, i))->row == row) {
+            array_delete(cache->matches, i);
+        }
+    }
+
+    m = array_data(cache->matches);
+    n = array_len(cache->matches);
+
+    switch (event->buff_mod_event) {
+        case BUFF_MOD_INSERT_LINE:
+        case BUFF_MOD_ADD_LINE:
+            cache->shifted += n - i;
+            for (; i < n; i += 1) { m[i].row += 1; }
+            break;
+        case BUFF_MOD_DELETE_LINE:
+            cache->shifted += n - i;
+            for (; i < n; i += 1) { m[i].row -= 1; }
+            break;
+        default:
+            scan_line_matches(cache, row, i);
+            break;
+    }
+}
+
+/* The match index for the current search, or NULL if there is no search. */
+static buffer_cache *search_index(yed_buffer *buff) {
+    buffer_cache *cache;
+    int           row;
+    int           n_lines;
+
+    if (ys->current_search == NULL || !*ys->current_search) { return NULL; }
+
+    cache = get_buffer_cache(buff);
+
+    if (cache->search != NULL && strcmp(cache->search, ys->current_search) == 0) {
+        return cache;
+    }
+
+    if (cache->search != NULL) { free(cache->search); }
+
+    cache->search = strdup(ys->current_search);
+    array_clear(cache->matches);
+
+    n_lines = yed_buff_n_lines(buff);
+    for (row = 1; row <= n_lines; row += 1) {
+        scan_line_matches(cache, row, array_len(cache->matches));
+    }
+
+    return cache;
+}
+
+/*
+ * Move to the nth next (or previous, for negative n) match, wrapping
+ * around the buffer.  Returns 0 if there is no search or no match.
+ */
+static int move_matches(int n) {
+    yed_frame    *f;
+    buffer_cache *cache;
+    search_match *m;
+    int           len;
+    int           i;
+
+    if (!ys->active_frame || !ys->active_frame->buffer)    { return 0; }
+
+    f     = ys->active_frame;
+    cache = search_index(f->buffer);
+
+    if (cache == NULL)                          { return 0; }
+    if ((len = array_len(cache->matches)) == 0) { return 0; }
+
+    m = array_data(cache->matches);
+
+    if (n > 0) {
+        i = match_lower_bound(cache, f->cursor_line, f->cursor_col + 1) + (n - 1);
+    } else {
+        i = match_lower_bound(cache, f->cursor_line, f->cursor_col) + n;
+    }
+
+    i %= len;
+    if (i < 0) { i += len; }
+
+    yed_set_cursor_within_frame(f, m[i].row, m[i].col);
+
+    return 1;
+}
+
+static int cursor_line(void) {
+    return ys->active_frame ? ys->active_frame->cursor_line : 0;
+}
+
+/*
+ * '}' goes to the last line of the paragraph that ends after the
+ * cursor line and '{' to the first line of the paragraph that starts
+ * before it.  Both search the buffer's blank line index.
+ */
+static int paragraph_end_after(buffer_cache *cache, int row, int n_lines) {
+    int *rows;
+    int  n;
+    int  i;
+
+    rows = array_data(cache->blank_rows);
+    n    = array_len(cache->blank_rows);
+
+    /* Skip blank lines after row. */
+    row += 1;
+    for (i = lower_bound(&cache->blank_rows, row); i < n && rows[i] == row; i += 1) {
+        row += 1;
+    }
+
+    if (row > n_lines) { return n_lines; }
+
+    return i < n ? rows[i] - 1 : n_lines;
+}
+
+static int paragraph_start_before(buffer_cache *cache, int row) {
+    int *rows;
+    int  i;
+
+    rows = array_data(cache->blank_rows);
+
+    /* Skip blank lines before row. */
+    row -= 1;
+    for (i = lower_bound(&cache->blank_rows, row + 1) - 1; i >= 0 && rows[i] == row; i -= 1) {
+        row -= 1;
+    }
+
+    if (row < 1) { return 1; }
+
+    return i >= 0 ? rows[i] + 1 : 1;
+}
+
+static void move_paragraphs(int n) {
+    yed_frame    *f;
+    buffer_cache *cache;
+    int           n_lines;
+    int           row;
+
+    if (!ys->active_frame || !ys->active_frame->buffer)    { return; }
+
+    f       = ys->active_frame;
+    cache   = blank_index(f->buffer);
+    n_lines = yed_buff_n_lines(f->buffer);
+    row     = f->cursor_line;
+
+    for (; n > 0; n -= 1) {
+        row = paragraph_end_after(cache, row, n_lines);
+    }
+    for (; n < 0; n += 1) {
+        row = paragraph_start_before(cache, row);
+    }
+
+    if (row != f->cursor_line) {
+        yed_set_cursor_within_frame(f, row, f->cursor_col);
+    }
+}
+
+/*
+ * Find the next word position for 'w' (next start), 'e' (next end), or
+ * 'b' (previous start) from row/col, moving to other lines if needed.
+ */
+static int next_word_pos(buffer_cache *cache, int key, int *row, int *col) {
+    array_t   *words;
+    word_span *spans;
+    int        n;
+    int        lo;
+    int        hi;
+    int        mid;
+    int        r;
+    int        n_lines;
+
+    words = line_words(cache, *row);
+    spans = array_data(*words);
+    n     = array_len(*words);
+    lo    = 0;
+    hi    = n;
+
+#define SPAN_COL(_i) (key == 'e' ? spans[(_i)].end_col : spans[(_i)].start_col)
+
+    if (key == 'b') {
+        while (lo < hi) {
+            mid = lo + ((hi - lo) / 2);
+            if (SPAN_COL(mid) < *col) { lo = mid + 1; }
+            else                      { hi = mid;     }
+        }
+        if (lo > 0) {
+            *col = SPAN_COL(lo - 1);
+            return 1;
+        }
+        for (r = *row - 1; r >= 1; r -= 1) {
+            words = line_words(cache, r);
+            if (array_len(*words)) {
+                *row = r;
+                *col = ((word_span*)array_last(*words))->start_col;
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    while (lo < hi) {
+        mid = lo + ((hi - lo) / 2);
+        if (SPAN_COL(mid) > *col) { hi = mid;     }
+        else                      { lo = mid + 1; }
+    }
+    if (lo < n) {
+        *col = SPAN_COL(lo);
+        return 1;
+    }
+
+    n_lines = yed_buff_n_lines(cache->buffer);
+    for (r = *row + 1; r <= n_lines; r += 1) {
+        words = line_words(cache, r);
+        if (array_len(*words)) {
+            spans = array_data(*words);
+            *row  = r;
+            *col  = SPAN_COL(0);
+            return 1;
+        }
+    }
+
+#undef SPAN_COL
+
+    return 0;
+}
+
+static void move_words(int key, int n) {
+    yed_frame    *f;
+    buffer_cache *cache;
+    int           row;
+    int           col;
+
+    if (!ys->active_frame || !ys->active_frame->buffer)    { return; }
+
+    f     = ys->active_frame;
+    cache = get_buffer_cache(f->buffer);
+    row   = f->cursor_line;
+    col   = f->cursor_col;
+
+    for (; n > 0; n -= 1) {
+        if (!next_word_pos(cache, key, &row, &col)) { break; }
+    }
+
+    if (row != f->cursor_line || col != f->cursor_col) {
+        yed_set_cursor_within_frame(f, row, col);
+    }
+}
+
+/* '%': jump to the bracket matching the one under or after the cursor on this line. */
+static void move_to_match(void) {
+    yed_frame    *f;
+    buffer_cache *cache;
+    bracket_tok  *toks;
+    int           i;
+
+    if (!ys->active_frame || !ys->active_frame->buffer)    { return; }
+
+    f     = ys->active_frame;
+    cache = bracket_index(f->buffer);
+    toks  = array_data(cache->brackets);
+    i     = bracket_lower_bound(cache, f->cursor_line, f->cursor_col);
+
+    for (; i < array_len(cache->brackets) && toks[i].row == f->cursor_line; i += 1) {
+        if (toks[i].match >= 0) {
+            yed_set_cursor_within_frame(f, toks[toks[i].match].row, toks[toks[i].match].col);
+            return;
+        }
+    }
+}
+
+/* The column just past the glyph at col. */
+static int col_after(yed_line *line, int col) {
+    if (line == NULL || col > line->visual_width) { return col + 1; }
+    return col + yed_get_glyph_width(yed_line_col_to_glyph(line, col));
+}
+
+/*
+ * Text objects.  Each fills in a range whose end column is exclusive
+ * (as select_range() expects) and returns 0 if there is no such object
+ * at the cursor.  Words come from the word cache, brackets from the
+ * bracket index, and paragraphs from the blank line index, so none of
+ * them scan more than the cursor line.
+ */
+typedef struct {
+    int kind;
+    int row1, col1;
+    int row2, col2;
+} text_range;
+
+static int word_object(int ia, int n, text_range *r) {
+    yed_frame    *f;
+    yed_line     *line;
+    array_t      *words;
+    word_span    *spans;
+    int           n_words;
+    int           col;
+    int           i;
+    int           last;
+
+    f       = ys->active_frame;
+    line    = yed_buff_get_line(f->buffer, f->cursor_line);
+    words   = line_words(get_buffer_cache(f->buffer), f->cursor_line);
+    spans   = array_data(*words);
+    n_words = array_len(*words);
+    col     = f->cursor_col;
+
+    if (line == NULL) { return 0; }
+
+    r->kind = RANGE_NORMAL;
+    r->row1 = r->row2 = f->cursor_line;
+
+    /* First span that ends at or after the cursor. */
+    for (i = 0; i < n_words && spans[i].end_col < col; i += 1);
+
+    if (i == n_words || spans[i].start_col > col) {
+        /* In a run of blanks: "iw" is the blanks, "aw" adds the next word. */
+        r->col1 = i > 0       ? col_after(line, spans[i - 1].end_col) : 1;
+        r->col2 = i < n_words ? spans[i].start_col                    : line->visual_width + 1;
+        if (ia == 'a' && i < n_words) {
+            last    = i + n - 1 < n_words ? i + n - 1 : n_words - 1;
+            r->col2 = col_after(line, spans[last].end_col);
+        }
+        /* An empty line is an empty word, so "ciw" there still inserts. */
+        return r->col1 < r->col2 || line->visual_width == 0;
+    }
+
+    last    = i + n - 1 < n_words ? i + n - 1 : n_words - 1;
+    r->col1 = spans[i].start_col;
+    r->col2 = col_after(line, spans[last].end_col);
+
+    if (ia == 'a') {
+        if (last + 1 < n_words && spans[last + 1].start_col > r->col2) {
+            r->col2 = spans[last + 1].start_col;
+        } else if (last + 1 == n_words && r->col2 <= line->visual_width) {
+            r->col2 = line->visual_width + 1;
+        } else if (i > 0 && col_after(line, spans[i - 1].end_col) < r->col1) {
+            /* No trailing blanks: take the leading ones. */
+            r->col1 = col_after(line, spans[i - 1].end_col);
+        } else if (i == 0) {
+            r->col1 = 1;
+        }
+    }
+
+    return 1;
+}
+
+static int quote_object(int ia, char q, text_range *r) {
+    yed_frame *f;
+    yed_line  *line;
+    char      *data;
+    int        len;
+    int        idx;
+    int        col;
+    int        open_col;
+    int        escaped;
+    yed_glyph *g;
+
+    f    = ys->active_frame;
+    line = yed_buff_get_line(f->buffer, f->cursor_line);
+
+    if (line == NULL) { return 0; }
+
+    data     = array_data(line->glyphs);
+    len      = array_len(line->glyphs);
+    idx      = 0;
+    col      = 1;
+    open_col = 0;
+    escaped  = 0;
+
+    /* Quotes pair up left to right; take the pair around or after the cursor. */
+    while (idx < len) {
+        g = (yed_glyph*)(data + idx);
+
+        if (g->c == q && !escaped) {
+            if (!open_col) {
+                open_col = col;
+            } else if (col >= f->cursor_col) {
+                r->kind = RANGE_NORMAL;
+                r->row1 = r->row2 = f->cursor_line;
+                r->col1 = ia == 'a' ? open_col : open_col + 1;
+                r->col2 = ia == 'a' ? col + 1  : col;
+                return 1;
+            } else {
+                open_col = 0;
+            }
+        }
+
+        escaped  = !escaped && g->c == '\\';
+        col     += yed_get_glyph_width(g);
+        idx     += yed_get_glyph_len(g);
+    }
+
+    return 0;
+}
+
+static int bracket_object(int ia, char open_c, int n, text_range *r) {
+    yed_frame    *f;
+    buffer_cache *cache;
+    bracket_tok  *o;
+    bracket_tok  *c;
+    int           i;
+
+    f     = ys->active_frame;
+    cache = bracket_index(f->buffer);
+    i     = enclosing_bracket(cache, open_c, f->cursor_line, f->cursor_col, n);
+
+    if (i < 0) { return 0; }
+
+    o = array_item(cache->brackets, i);
+    c = array_item(cache->brackets, o->match);
+
+    r->kind = RANGE_NORMAL;
+    r->row1 = o->row;
+    r->col1 = ia == 'a' ? o->col     : o->col + 1;
+    r->row2 = c->row;
+    r->col2 = ia == 'a' ? c->col + 1 : c->col;
+
+    return 1;
+}
+
+/* The run of blank or non-blank lines that row is in. */
+static void paragraph_item(buffer_cache *cache, int row, int n_lines, int *start, int *end) {
+    int *rows;
+    int  n;
+    int  i;
+    int  j;
+
+    rows = array_data(cache->blank_rows);
+    n    = array_len(cache->blank_rows);
+    i    = lower_bound(&cache->blank_rows, row);
+
+    if (i < n && rows[i] == row) {
+        for (j = i; j > 0     && rows[j - 1] == rows[j] - 1; j -= 1);
+        *start = rows[j];
+        for (j = i; j < n - 1 && rows[j + 1] == rows[j] + 1; j += 1);
+        *end   = rows[j];
+    } else {
+        *start = i > 0 ? rows[i - 1] + 1 : 1;
+        *end   = i < n ? rows[i] - 1     : n_lines;
+    }
+}
+
+static int paragraph_object(int ia, int n, text_range *r) {
+    yed_frame    *f;
+    buffer_cache *cache;
+    int           n_lines;
+    int           start;
+    int           end;
+    int           items;
+
+    f       = ys->active_frame;
+    cache   = blank_index(f->buffer);
+    n_lines = yed_buff_n_lines(f->buffer);
+
+    paragraph_item(cache, f->cursor_line, n_lines, &r->row1, &r->row2);
+
+    /* "ap" is a paragraph and the blank lines after it (or the reverse). */
+    for (items = (ia == 'a' ? 2 * n : n) - 1; items > 0 && r->row2 < n_lines; items -= 1) {
+        paragraph_item(cache, r->row2 + 1, n_lines, &start, &r->row2);
+    }
+
+    if (ia == 'a' && items > 0 && r->row1 > 1) {
+        /* Ran out at the end of the buffer: take the blank lines before instead. */
+        paragraph_item(cache, r->row1 - 1, n_lines, &r->row1, &end);
+    }
+
+    r->kind = RANGE_LINE;
+    r->col1 = r->col2 = 1;
+
+    return 1;
+}
+
+static int text_object(int ia, int obj, int n, text_range *r) {
+    if (!ys->active_frame || !ys->active_frame->buffer)    { return 0; }
+
+    switch (obj) {
+        case 'w': case 'W':           return word_object(ia, n, r);
+        case '"': case '\'': case '`': return quote_object(ia, obj, r);
+        case '(': case ')': case 'b': return bracket_object(ia, '(', n, r);
+        case '[': case ']':           return bracket_object(ia, '[', n, r);
+        case '{': case '}': case 'B': return bracket_object(ia, '{', n, r);
+        case 'p':                     return paragraph_object(ia, n, r);
+    }
+
+    return 0;
+}
+
+/*
+ * n is the count typed for the motion, 0 if none (which counts as 1;
+ * "G" tells the two apart).
+ * Motions that have a direct target compute it up front and move
+ * the cursor exactly once, so that "10000j" costs the same as "j".
+ */
+int nav_common(int key, int n) {
+    int r;
+
+    TRACE_BEGIN("nav_common");
+    r = _nav_common(key, n);
+    TRACE_END("nav_common");
+
+    return r;
+}
+
+static int _nav_common(int key, int n) {
+    int given;
+    int has_sel;
+    int is_line_sel;
+    int save_cursor_line;
+
+    given = n;
+    if (n < 1) { n = 1; }
+
+    if (till_pending == 1) {
+        do_till_fw(key);
+        goto out;
+    } else if (till_pending > 1) {
+        do_till_bw(key, till_pending == 3);
+        goto out;
+    }
+
+    has_sel     =     ys->active_frame
+                   && ys->active_frame->buffer
+                   && ys->active_frame->buffer->has_selection;
+
+    is_line_sel =     has_sel
+                   ? ys->active_frame->buffer->selection.kind == RANGE_LINE
+                   : virt_line_sel;
+
+    if (!has_sel) {
+        select_cursor_line();
+    }
+
+    switch (key) {
+        case 'h':
+        case ARROW_LEFT:
+            if (!visual) {
+                XEXE(CMD_SELECT_OFF);
+                XEXE(CMD_SELECT);
+            }
+            move_cursor_cols(-n);
+            break;
+        case 'H':
+            if (!visual && is_line_sel) {
+                XEXE(CMD_SELECT_OFF);
+                XEXE(CMD_SELECT);
+            }
+            move_cursor_cols(-n);
+            break;
+
+        case 'j':
+        case ARROW_DOWN:
+            if (visual) {
+                move_cursor_lines(n);
+            } else {
+                XEXE(CMD_SELECT_OFF);
+                move_cursor_lines(n);
+                select_cursor_line();
+            }
+            break;
+        case 'J':
+            move_cursor_lines(n);
+            break;
+
+        case 'k':
+        case ARROW_UP:
+            if (visual) {
+                move_cursor_lines(-n);
+            } else {
+                XEXE(CMD_SELECT_OFF);
+                move_cursor_lines(-n);
+                select_cursor_line();
+            }
+            break;
+        case 'K':
+            move_cursor_lines(-n);
+            break;
+
+        case 'l':
+        case ARROW_RIGHT:
+            if (!visual) {
+                XEXE(CMD_SELECT_OFF);
+                XEXE(CMD_SELECT);
+            }
+        case 'L':
+            if (!visual && is_line_sel) {
+                XEXE(CMD_SELECT_OFF);
+                XEXE(CMD_SELECT);
+            }
+            move_cursor_cols(n);
+            break;
+
+        case PAGE_UP:
+            if (!visual) {
+                XEXE(CMD_SELECT_OFF);
+            }
+            if (n == 1 || ys->active_frame == NULL) {
+                XEXE(CMD_CURSOR_PAGE_UP);
+            } else {
+                move_cursor_lines(-n * ys->active_frame->height);
+            }
+            if (!visual) {
+                select_cursor_line();
+            }
+            break;
+
+        case PAGE_DOWN:
+            if (!visual) {
+                XEXE(CMD_SELECT_OFF);
+            }
+            if (n == 1 || ys->active_frame == NULL) {
+                XEXE(CMD_CURSOR_PAGE_DOWN);
+            } else {
+                move_cursor_lines(n * ys->active_frame->height);
+            }
+            if (!visual) {
+                select_cursor_line();
+            }
+            break;
+
+        case 'w':
+            if (!visual) {
+                XEXE(CMD_SELECT_OFF);
+                XEXE(CMD_SELECT);
+            }
+        case 'W':
+            if (!visual && is_line_sel) {
+                XEXE(CMD_SELECT_OFF);
+                XEXE(CMD_SELECT);
+            }
+            move_words('w', n);
+            break;
+
+        case 'e':
+            if (!visual) {
+                XEXE(CMD_SELECT_OFF);
+                XEXE(CMD_SELECT);
+            }
+        case 'E':
+            if (!visual && is_line_sel) {
+                XEXE(CMD_SELECT_OFF);
+                XEXE(CMD_SELECT);
+            }
+            move_words('e', n);
+            break;
+
+        case 'b':
+            if (!visual) {
+                XEXE(CMD_SELECT_OFF);
+                XEXE(CMD_SELECT);
+            }
+        case 'B':
+            if (!visual && is_line_sel) {
+                XEXE(CMD_SELECT_OFF);
+                XEXE(CMD_SELECT);
+            }
+            move_words('b', n);
+            break;
+
+        case '0':
+        case HOME_KEY:
+            if (!visual) {
+                XEXE(CMD_SELECT_OFF);
+                XEXE(CMD_SELECT);
+            }
+            XEXE(CMD_CURSOR_LINE_BEGIN);
+            break;
+
+        case '$':
+        case END_KEY:
+            if (!visual) {
+                XEXE(CMD_SELECT_OFF);
+                XEXE(CMD_SELECT);
+            }
+            XEXE(CMD_CURSOR_LINE_END);
+            break;
+
+        case '{':
+            if (!visual) {
+                XEXE(CMD_SELECT_OFF);
+                select_cursor_line();
+            }
+            move_paragraphs(-n);
+            break;
+
+        case '}':
+            if (!visual) {
+                XEXE(CMD_SELECT_OFF);
+                select_cursor_line();
+            }
+            move_paragraphs(n);
+            break;
+
+        case 'g':
+        case 'G':
+            if (!visual) {
+                XEXE(CMD_SELECT_OFF);
+            }
+            if (given) {
+                /* "42g" and "42G" both go to line 42. */
+                move_cursor_lines(n - cursor_line());
+            } else if (key == 'g') {
+                XEXE(CMD_CURSOR_BUFFER_BEGIN);
+            } else {
+                XEXE(CMD_CURSOR_BUFFER_END);
+            }
+            if (!visual) {
+                select_cursor_line();
+            }
+            break;
+
+        case '/':
+            if (!visual) {
+                XEXE(CMD_SELECT_OFF);
+                XEXE(CMD_SELECT);
+            }
+            save_cursor_line = cursor_line();
+            YEXE_COUNTED("find-in-buffer");
+            if (cursor_line() != save_cursor_line) {
+                XEXE(CMD_SELECT_OFF);
+            }
+            break;
+
+        case '?':
+            YEXE_COUNTED("replace-current-search");
+            break;
+
+        case 'n':
+            if (!visual) {
+                XEXE(CMD_SELECT_OFF);
+                XEXE(CMD_SELECT);
+            }
+            save_cursor_line = cursor_line();
+            if (!move_matches(n)) {
+                /* No search or no match: let yed report it. */
+                XEXE(CMD_FIND_NEXT_IN_BUFFER);
+            }
+            if (cursor_line() != save_cursor_line) {
+                XEXE(CMD_SELECT_OFF);
+                select_cursor_line();
+            }
+            break;
+
+        case 'N':
+            if (!visual) {
+                XEXE(CMD_SELECT_OFF);
+                XEXE(CMD_SELECT);
+            }
+            save_cursor_line = cursor_line();
+            if (!move_matches(-n)) {
+                XEXE(CMD_FIND_PREV_IN_BUFFER);
+            }
+            if (cursor_line() != save_cursor_line) {
+                XEXE(CMD_SELECT_OFF);
+                select_cursor_line();
+            }
+            break;
+
+        case 'f':
+        case 't':
+            if (!visual) {
+                XEXE(CMD_SELECT_OFF);
+                XEXE(CMD_SELECT);
+            }
+            till_pending = 1;
+            till_count   = n;
+            last_till_op = key;
+            break;
+
+        case 'F':
+        case 'T':
+            if (!visual) {
+                XEXE(CMD_SELECT_OFF);
+                XEXE(CMD_SELECT);
+            }
+            till_pending = 2 + (key == 'T');
+            till_count   = n;
+            last_till_op = key;
+            break;
+
+        case ';':
+        case ',':
+            if (!visual) {
+                XEXE(CMD_SELECT_OFF);
+                XEXE(CMD_SELECT);
+            }
+            do_till_repeat(key == ',', n);
+            break;
+
+        case '%':
+            if (!visual) {
+                XEXE(CMD_SELECT_OFF);
+                XEXE(CMD_SELECT);
+            }
+            move_to_match();
+            break;
+
+        default:
+            return 0;
+    }
+
+    if (isprint(key)) {
+        switch (key) {
+            case 'f':
+            case 'F':
+            case 't':
+            case 'T':
+                last_nav_key = key;
+                break;
+            default:
+                last_nav_key = tolower(key);
+                break;
+        }
+    } else {
+        last_nav_key = key;
+    }
+    last_nav_count = given;
+
+out:;
+    return 1;
+}
+
+static int is_line_motion(int key) {
+    switch (key) {
+        case 'j': case 'J': case ARROW_DOWN:
+        case 'k': case 'K': case ARROW_UP:
+        case PAGE_UP: case PAGE_DOWN:
+        case '{': case '}':
+        case 'g': case 'G':
+            return 1;
+    }
+    return 0;
+}
+
+static int is_motion(int key) {
+    if (is_line_motion(key)) { return 1; }
+
+    switch (key) {
+        case 'h': case 'H': case ARROW_LEFT:
+        case 'l': case 'L': case ARROW_RIGHT:
+        case 'w': case 'W':
+        case 'e': case 'E':
+        case 'b': case 'B':
+        case '0': case HOME_KEY:
+        case '$': case END_KEY:
+        case 'n': case 'N':
+        case 'f': case 't':
+        case 'F': case 'T':
+        case ';': case ',':
+        case '%':
+            return 1;
+    }
+    return 0;
+}
+
+static void select_range(int kind, int row1, int col1, int row2, int col2) {
+    yed_frame *f;
+
+    f = ys->active_frame;
+
+    XEXE(CMD_SELECT_OFF);
+    yed_set_cursor_within_frame(f, row1, col1);
+    xexe(kind == RANGE_LINE ? CMD_SELECT_LINES : CMD_SELECT, 0, NULL);
+    yed_set_cursor_within_frame(f, row2, col2);
+}
+
+/* Apply an operator to the current selection. */
+static void op_on_selection(int op) {
+    int n_records;
+
+    visual = 0;
+
+    switch (op) {
+        case 'c':
+            n_records = ys->active_frame && ys->active_frame->buffer
+                            ? yed_get_undo_num_records(ys->active_frame->buffer)
+                            : 0;
+            XEXE(CMD_YANK_SELECTION, "1");
+            XEXE(CMD_DELETE_BACK);
+            XEXE(CMD_SELECT_OFF);
+            change_mode(MODE_INSERT);
+            /* Fold the delete into the insert's undo record. */
+            num_undo_records_before_insert = n_records;
+            break;
+        case 'd':
+            if (start_chunked('d')) { break; }
+            XEXE(CMD_YANK_SELECTION, "1");
+            XEXE(CMD_DELETE_BACK);
+            XEXE(CMD_SELECT_OFF);
+            select_cursor_line();
             break;
+        case 'y':
+            if (start_chunked('y')) { break; }
+            XEXE(CMD_YANK_SELECTION);
+            XEXE(CMD_SELECT_OFF);
+            select_cursor_line();
+            break;
+    }
+}
+
+/*
+ * Run an operator over the range covered by a motion.
+ * The range is computed by moving the cursor only (selection
+ * bookkeeping is suppressed), then selected once and handed to
+ * a single yank/delete, so each operator costs one undo record.
+ */
+static void op_run(int op, int motion, int n, int till_key) {
+    yed_frame *f;
+    yed_line  *line;
+    yed_glyph *g;
+    int        given;
+    int        save_visual;
+    int        start_row, start_col;
+    int        end_row, end_col;
+    int        tmp;
+    int        inclusive;
+    text_range obj;
+    array_t   *words;
+
+    if (!ys->active_frame || !ys->active_frame->buffer)    { return; }
+
+    f = ys->active_frame;
+
+    given = n;
+    if (n < 1) { n = 1; }
+
+    start_row = f->cursor_line;
+    start_col = f->cursor_col;
+
+    if (motion == op) {
+        /* Doubled operator: "dd", "3yy", "cc". */
+        end_row = start_row + n - 1;
+        if (end_row > yed_buff_n_lines(f->buffer)) {
+            end_row = yed_buff_n_lines(f->buffer);
+        }
+
+        if (op == 'c') {
+            line = yed_buff_get_line(f->buffer, end_row);
+            select_range(RANGE_NORMAL, start_row, 1, end_row, line ? line->visual_width + 1 : 1);
+        } else {
+            select_range(RANGE_LINE, start_row, 1, end_row, 1);
+        }
+        goto apply;
+    }
+
+    if (motion == 'i' || motion == 'a') {
+        /* Text object: "diw", "ca(", "yip"; till_key names the object. */
+        if (!text_object(motion, till_key, n, &obj)) {
+            XEXE(CMD_SELECT_OFF);
+            select_cursor_line();
+            return;
+        }
+
+        start_row = obj.row1;
+        start_col = obj.col1;
+
+        if (obj.kind == RANGE_NORMAL && obj.row1 == obj.row2 && obj.col1 == obj.col2) {
+            /* Nothing inside, e.g. 'ci"' on "": change still inserts there. */
+            yed_set_cursor_within_frame(f, start_row, start_col);
+            XEXE(CMD_SELECT_OFF);
+            if (op == 'c') {
+                change_mode(MODE_INSERT);
+                goto save;
+            }
+            select_cursor_line();
+            return;
+        }
+
+        select_range(obj.kind, obj.row1, obj.col1, obj.row2, obj.col2);
+        goto apply;
+    }
+
+    save_visual = visual;
+    visual      = 1;
+
+    nav_common(motion, given);
+    if (till_pending) {
+        nav_common(till_key, 1);
+    }
+
+    visual = save_visual;
+
+    end_row = f->cursor_line;
+    end_col = f->cursor_col;
+
+    if (motion == 'w' || motion == 'W') {
+        /*
+         * As in vi, a word motion that lands on the first word of a later
+         * line (or finds no next word) stops at the end of the line before.
+         */
+        if (end_row > start_row) {
+            words = line_words(get_buffer_cache(f->buffer), end_row);
+            if (array_len(*words) && ((word_span*)array_data(*words))->start_col == end_col) {
+                end_row -= 1;
+                line     = yed_buff_get_line(f->buffer, end_row);
+                end_col  = line ? line->visual_width + 1 : 1;
+            }
+        } else if (end_row == start_row && end_col == start_col) {
+            line    = yed_buff_get_line(f->buffer, end_row);
+            end_col = line ? line->visual_width + 1 : 1;
+        }
+    }
+
+    if (is_line_motion(motion)) {
+        if (end_row < start_row) {
+            tmp = start_row; start_row = end_row; end_row = tmp;
+        }
+        select_range(RANGE_LINE, start_row, 1, end_row, 1);
+        goto apply;
+    }
+
+    /* Forward 'f' (and repeats of it), 'e', and '%' include the target character. */
+    inclusive =    motion == 'f' || motion == 'e' || motion == 'E' || motion == '%'
+                || ((motion == ';' || motion == ',') && tolower(last_till_op) == 'f');
+
+    if (end_row < start_row || (end_row == start_row && end_col < start_col)) {
+        tmp = start_row; start_row = end_row; end_row = tmp;
+        tmp = start_col; start_col = end_col; end_col = tmp;
+        /* Going back, only '%' covers the character it started on. */
+        inclusive = motion == '%';
+    }
+
+    if (inclusive && (end_row != start_row || end_col != start_col)) {
+        line = yed_buff_get_line(f->buffer, end_row);
+        if (line && end_col <= line->visual_width) {
+            g        = yed_line_col_to_glyph(line, end_col);
+            end_col += yed_get_glyph_width(g);
+        }
+    }
+
+    if (end_row == start_row && end_col == start_col) {
+        /* Empty range; change still inserts there. */
+        yed_set_cursor_within_frame(f, start_row, start_col);
+        XEXE(CMD_SELECT_OFF);
+        if (op == 'c') {
+            change_mode(MODE_INSERT);
+            goto save;
+        }
+        select_cursor_line();
+        return;
+    }
+
+    select_range(RANGE_NORMAL, start_row, start_col, end_row, end_col);
+
+apply:;
+    op_on_selection(op);
+
+    if (op == 'y') {
+        yed_set_cursor_within_frame(f, start_row, start_col);
+        XEXE(CMD_SELECT_OFF);
+        select_cursor_line();
+    }
+
+save:;
+    if (!repeating) {
+        save_action      = op;
+        save_op_motion   = motion;
+        save_op_count    = given;
+        save_op_till_key = till_key;
+    }
+}
+
+/* Handle a key while an operator is waiting for its motion; n is the count typed, 0 if none. */
+static void op_pending_key(int key, int n) {
+    int op;
+
+    op = op_pending;
+
+    if (op_motion) {
+        op_pending = 0;
+        op_run(op, op_motion, op_count, key);
+        op_motion  = 0;
+        return;
+    }
+
+    /* Counts before the operator and the motion multiply; 0 is none. */
+    n = op_count && n ? op_count * n : op_count + n;
+
+    switch (key) {
+        case 'f':
+        case 't':
+        case 'F':
+        case 'T':
+        case 'i':
+        case 'a':
+            op_count  = n;
+            op_motion = key;
+            return;
+    }
+
+    op_pending = 0;
+
+    if (key == op || is_motion(key)) {
+        op_run(op, key, n, 0);
+    } else {
+        /* ESC, CTRL_C, or anything else cancels. */
+        XEXE(CMD_SELECT_OFF);
+        select_cursor_line();
+    }
+}
+
+/*
+ * Multiple selections.
+ *
+ * A buffer can hold a sorted list of non-overlapping ranges in place
+ * of yed's one selection ('*' makes one per search match).  c, d, y,
+ * p, i, a, and typing in insert mode then act on all of them at once.
+ * An edit is applied in one pass from the last range to the first, so
+ * the ranges not yet edited never move, and a second, forward pass
+ * carries each range to its new position.  Each pass is one undo record.
+ */
+typedef struct {
+    int row;  /* original row of the last edit's end */
+    int drow; /* lines added (or removed) so far */
+    int dcol; /* column shift for the rest of that row */
+} pos_shift;
+
+static void shift_pos(pos_shift *sh, int *row, int *col) {
+    if (*row == sh->row) { *col += sh->dcol; }
+    *row += sh->drow;
+}
+
+static int pos_cmp(int row1, int col1, int row2, int col2) {
+    if (row1 != row2) { return row1 - row2; }
+    return col1 - col2;
+}
+
+static buffer_cache *active_sels(void) {
+    buffer_cache *cache;
+
+    if (!ys->active_frame || !ys->active_frame->buffer)    { return NULL; }
+
+    cache = find_buffer_cache(ys->active_frame->buffer);
+
+    return cache != NULL && array_len(cache->sels) ? cache : NULL;
+}
+
+static void clear_sels(buffer_cache *cache) {
+    array_clear(cache->sels);
+    request_redraw();
+}
+
+/* Merge ranges that came to overlap (or cursors that met) after an edit. */
+static void normalize_sels(buffer_cache *cache) {
+    xsel *sels;
+    int   n;
+    int   i;
+    int   j;
+
+    sels = array_data(cache->sels);
+    n    = array_len(cache->sels);
+
+    for (i = 1, j = 0; i < n; i += 1) {
+        if (pos_cmp(sels[i].row1, sels[i].col1, sels[j].row2, sels[j].col2) < 0
+        ||  (sels[i].row1 == sels[j].row1 && sels[i].col1 == sels[j].col1
+          && sels[i].row2 == sels[j].row2 && sels[i].col2 == sels[j].col2)) {
+
+            if (pos_cmp(sels[i].row2, sels[i].col2, sels[j].row2, sels[j].col2) > 0) {
+                sels[j].row2 = sels[i].row2;
+                sels[j].col2 = sels[i].col2;
+            }
+        } else {
+            j       += 1;
+            sels[j]  = sels[i];
+        }
+    }
+
+    while (n > 0 && array_len(cache->sels) > j + 1) {
+        array_pop(cache->sels);
+    }
+
+    request_redraw();
+}
+
+/* Put the cursor on the first selection at or after it, or on the first one. */
+static void place_cursor(buffer_cache *cache) {
+    yed_frame *f;
+    xsel      *sels;
+    int        n;
+    int        i;
+
+    f    = ys->active_frame;
+    sels = array_data(cache->sels);
+    n    = array_len(cache->sels);
+
+    for (i = sel_lower_bound(cache, f->cursor_line); i < n; i += 1) {
+        if (pos_cmp(sels[i].row2, sels[i].col2, f->cursor_line, f->cursor_col) >= 0) { break; }
+    }
+    if (i == n) { i = 0; }
+
+    if (n) {
+        yed_set_cursor_within_frame(f, sels[i].row2, sels[i].col2);
+    }
+}
+
+static int col_idx(yed_line *line, int col) {
+    if (col > line->visual_width) { return array_len(line->glyphs); }
+    return yed_line_col_to_idx(line, col);
+}
+
+static int idx_col(yed_line *line, int idx) {
+    if (idx >= array_len(line->glyphs)) { return line->visual_width + 1; }
+    return yed_line_idx_to_col(line, idx);
+}
+
+static char *range_text(yed_buffer *buff, xsel *sel) {
+    array_t   text;
+    yed_line *line;
+    int       row;
+    int       start;
+    int       end;
+    char      nl;
+
+    text = array_make(char);
+    nl   = '\n';
+
+    for (row = sel->row1; row <= sel->row2; row += 1) {
+        if ((line = yed_buff_get_line(buff, row)) == NULL) { break; }
+
+        start = row == sel->row1 ? col_idx(line, sel->col1) : 0;
+        end   = row == sel->row2 ? col_idx(line, sel->col2) : array_len(line->glyphs);
+
+        if (row > sel->row1) { array_push(text, nl); }
+        if (end > start)     { array_push_n(text, (char*)array_data(line->glyphs) + start, end - start); }
+    }
+
+    array_zero_term(text);
+
+    return array_data(text);
+}
+
+static void delete_text(yed_buffer *buff, int row1, int col1, int row2, int col2) {
+    yed_line  *line;
+    char      *data;
+    char      *tail;
+    char      *text;
+    int        len;
+    int        idx;
+    int        end;
+    int        n;
+
+    if (pos_cmp(row1, col1, row2, col2) >= 0) { return; }
+
+    tail = NULL;
+
+    if (row2 > row1) {
+        /* Keep what follows the range on its last line, then drop the lines. */
+        line = yed_buff_get_line(buff, row2);
+        idx  = col_idx(line, col2);
+        tail = strndup((char*)array_data(line->glyphs) + idx, array_len(line->glyphs) - idx);
+
+        for (n = row2 - row1; n > 0; n -= 1) {
+            yed_buff_delete_line(buff, row1 + 1);
+        }
+    }
+
+    line = yed_buff_get_line(buff, row1);
+    data = array_data(line->glyphs);
+    len  = array_len(line->glyphs);
+    idx  = col_idx(line, col1);
+    end  = tail != NULL ? len : col_idx(line, col2);
+
+    if (tail == NULL && idx >= end) { return; }
+
+    /*
+     * Put the line back together once instead of deleting glyph by
+     * glyph, which would move (and rescan) the rest of the line per glyph.
+     */
+    n    = tail != NULL ? (int)strlen(tail) : len - end;
+    text = malloc(idx + n + 1);
+    memcpy(text, data, idx);
+    memcpy(text + idx, tail != NULL ? tail : data + end, n);
+    text[idx + n] = 0;
+
+    yed_buff_clear_line(buff, row1);
+    if (*text) { yed_buff_insert_string(buff, text, row1, 1); }
+
+    free(text);
+    free(tail);
+}
+
+/*
+ * Cut several ranges (sorted, not overlapping, each within the line)
+ * out of one line in a single walk over it.
+ */
+static void delete_line_ranges(yed_buffer *buff, int row, xsel *sels, int n) {
+    yed_line  *line;
+    yed_glyph *g;
+    char      *data;
+    char      *text;
+    int        len;
+    int        idx;
+    int        col;
+    int        out;
+    int        g_len;
+    int        i;
+
+    line = yed_buff_get_line(buff, row);
+    data = array_data(line->glyphs);
+    len  = array_len(line->glyphs);
+    text = malloc(len + 1);
+    idx  = 0;
+    col  = 1;
+    out  = 0;
+    i    = 0;
+
+    while (idx < len) {
+        g     = (yed_glyph*)(data + idx);
+        g_len = yed_get_glyph_len(g);
+
+        while (i < n && sels[i].col2 <= col) { i += 1; }
+
+        if (i == n || col < sels[i].col1) {
+            memcpy(text + out, data + idx, g_len);
+            out += g_len;
+        }
+
+        col += yed_get_glyph_width(g);
+        idx += g_len;
+    }
+
+    text[out] = 0;
+
+    if (out < len) {
+        yed_buff_clear_line(buff, row);
+        if (out) { yed_buff_insert_string(buff, text, row, 1); }
+    }
+
+    free(text);
+}
+
+/* Insert text at row/col and report where it ends. */
+static void insert_text(yed_buffer *buff, int row, int col, const char *text, int *end_row, int *end_col) {
+    yed_line   *line;
+    const char *nl;
+    const char *last_nl;
+    int         idx;
+    int         n_nl;
+
+    n_nl    = 0;
+    last_nl = NULL;
+
+    for (nl = text; (nl = strchr(nl, '\n')) != NULL; nl += 1) {
+        n_nl    += 1;
+        last_nl  = nl;
+    }
+
+    /* Byte offset of the end of the text on its last line. */
+    line = yed_buff_get_line(buff, row);
+    idx  = last_nl != NULL ? (int)strlen(last_nl + 1) : col_idx(line, col) + (int)strlen(text);
+
+    yed_buff_insert_string(buff, text, row, col);
+
+    line = yed_buff_get_line(buff, row + n_nl);
+
+    *end_row = row + n_nl;
+    *end_col = idx >= array_len(line->glyphs) ? line->visual_width + 1 : yed_line_idx_to_col(line, idx);
+}
+
+/* Delete the text of every selection; each becomes a cursor where it was. */
+static void multi_delete(buffer_cache *cache) {
+    yed_frame *f;
+    xsel      *sels;
+    int        n;
+    int        i;
+    int        j;
+    int        row;
+    int        col;
+    pos_shift  sh;
+
+    f    = ys->active_frame;
+    sels = array_data(cache->sels);
+    n    = array_len(cache->sels);
+
+    multi_editing = 1;
+    yed_start_undo_record(f, cache->buffer);
+    for (i = n - 1; i >= 0; i = j) {
+        /* Selections within the same line are cut out of it together. */
+        for (j = i; j >= 0 && sels[j].row1 == sels[i].row2 && sels[j].row2 == sels[i].row2; j -= 1);
+
+        if (j == i) {
+            delete_text(cache->buffer, sels[i].row1, sels[i].col1, sels[i].row2, sels[i].col2);
+            j = i - 1;
+        } else {
+            delete_line_ranges(cache->buffer, sels[i].row2, sels + j + 1, i - j);
+        }
+    }
+    yed_end_undo_record(f, cache->buffer);
+    multi_editing = 0;
+
+    memset(&sh, 0, sizeof(sh));
+
+    for (i = 0; i < n; i += 1) {
+        row = sels[i].row1;
+        col = sels[i].col1;
+        shift_pos(&sh, &row, &col);
+
+        sh.drow -= sels[i].row2 - sels[i].row1;
+        sh.dcol  = col - sels[i].col2;
+        sh.row   = sels[i].row2;
+
+        sels[i].row1 = sels[i].row2 = row;
+        sels[i].col1 = sels[i].col2 = col;
+    }
+
+    normalize_sels(cache);
+    place_cursor(cache);
+}
+
+/*
+ * Insert text at the start (or end) of every selection, cycling
+ * through n_texts strings.  Afterwards each selection is either the
+ * inserted text or a cursor just after it.
+ */
+static void multi_insert(buffer_cache *cache, char **texts, int n_texts, int at_end, int select_inserted) {
+    yed_frame *f;
+    xsel      *sels;
+    int        n;
+    int        i;
+    int        row;
+    int        col;
+    int        end_row;
+    int        end_col;
+    int       *shape;
+    pos_shift  sh;
+
+    f     = ys->active_frame;
+    sels  = array_data(cache->sels);
+    n     = array_len(cache->sels);
+    shape = malloc(2 * n * sizeof(int));
+
+    multi_editing = 1;
+    yed_start_undo_record(f, cache->buffer);
+    for (i = n - 1; i >= 0; i -= 1) {
+        row = at_end ? sels[i].row2 : sels[i].row1;
+        col = at_end ? sels[i].col2 : sels[i].col1;
+
+        insert_text(cache->buffer, row, col, texts[i % n_texts], &end_row, &end_col);
+
+        /* Lines added, and where the end lands relative to its line's start or col. */
+        shape[2 * i]     = end_row - row;
+        shape[2 * i + 1] = end_col - (end_row > row ? 1 : col);
+    }
+    yed_end_undo_record(f, cache->buffer);
+    multi_editing = 0;
+
+    memset(&sh, 0, sizeof(sh));
+
+    for (i = 0; i < n; i += 1) {
+        row = at_end ? sels[i].row2 : sels[i].row1;
+        col = at_end ? sels[i].col2 : sels[i].col1;
+
+        end_row = row;
+        end_col = col;
+        shift_pos(&sh, &end_row, &end_col);
+
+        sels[i].row1 = end_row;
+        sels[i].col1 = end_col;
+
+        end_col  = (shape[2 * i] ? 1 : end_col) + shape[2 * i + 1];
+        end_row += shape[2 * i];
+
+        sh.drow += shape[2 * i];
+        sh.dcol  = end_col - col;
+        sh.row   = row;
+
+        if (!select_inserted) {
+            sels[i].row1 = end_row;
+            sels[i].col1 = end_col;
+        }
+        sels[i].row2 = end_row;
+        sels[i].col2 = end_col;
+    }
+
+    free(shape);
+
+    normalize_sels(cache);
+    place_cursor(cache);
+}
+
+/* BACKSPACE at every cursor (not past the start of its line). */
+static void multi_backspace(buffer_cache *cache) {
+    xsel     *sels;
+    yed_line *line;
+    char     *data;
+    int       n;
+    int       i;
+    int       idx;
+
+    sels = array_data(cache->sels);
+    n    = array_len(cache->sels);
+
+    for (i = 0; i < n; i += 1) {
+        if (sels[i].col2 <= 1) { continue; }
+        if ((line = yed_buff_get_line(cache->buffer, sels[i].row2)) == NULL) { continue; }
+
+        data = array_data(line->glyphs);
+        idx  = col_idx(line, sels[i].col2);
+
+        /* Back up over one UTF-8 sequence. */
+        do { idx -= 1; } while (idx > 0 && (data[idx] & 0xC0) == 0x80);
+
+        sels[i].row1 = sels[i].row2;
+        sels[i].col1 = yed_line_idx_to_col(line, idx);
+    }
+
+    multi_delete(cache);
+}
+
+static void multi_yank(buffer_cache *cache) {
+    char **it;
+    xsel  *sel;
+    char  *text;
+
+    array_traverse(multi_yanks, it) {
+        free(*it);
+    }
+    array_clear(multi_yanks);
+
+    array_traverse(cache->sels, sel) {
+        text = range_text(cache->buffer, sel);
+        array_push(multi_yanks, text);
+    }
+}
+
+/* Make every selection a cursor at its start (or end). */
+static void collapse_sels(buffer_cache *cache, int to_end) {
+    xsel *sel;
+
+    array_traverse(cache->sels, sel) {
+        if (to_end) {
+            sel->row1 = sel->row2;
+            sel->col1 = sel->col2;
+        } else {
+            sel->row2 = sel->row1;
+            sel->col2 = sel->col1;
+        }
+    }
+
+    normalize_sels(cache);
+}
+
+/*
+ * Normal mode keys while there are multiple selections.  Returns 0 for
+ * keys that don't work across selections: those drop back to the
+ * single selection and are handled as usual.
+ */
+static int multi_key(buffer_cache *cache, int key) {
+    int n_records;
+
+    switch (key) {
+        case 'c':
+            n_records = yed_get_undo_num_records(cache->buffer);
+            multi_yank(cache);
+            multi_delete(cache);
+            change_mode(MODE_INSERT);
+            /* Fold the deletes into the insert's undo record. */
+            num_undo_records_before_insert = n_records;
+            return 1;
+        case 'd':
+            multi_yank(cache);
+            multi_delete(cache);
+            return 1;
+        case 'y':
+            multi_yank(cache);
+            return 1;
+        case 'p':
+            if (array_len(multi_yanks) == 0) { break; }
+            multi_insert(cache, array_data(multi_yanks), array_len(multi_yanks), 1, 1);
+            return 1;
+        case 'i':
+        case 'a':
+            collapse_sels(cache, key == 'a');
+            change_mode(MODE_INSERT);
+            return 1;
+        case '*':
+        case 's':
+        case 'S':
+        case ':':
+        case 'q':
+        case '@':
+            return 0;
+    }
+
+    clear_sels(cache);
+
+    if (key == ESC || key == CTRL_C) {
+        select_cursor_line();
+        return 1;
+    }
+
+    return 0;
+}
+
+void xul_select_matches(int n_args, char **args) {
+    yed_frame    *f;
+    buffer_cache *cache;
+    search_match *m;
+    xsel          sel;
+
+    if (!ys->active_frame || !ys->active_frame->buffer) {
+        yed_cerr("no active buffer");
+        return;
+    }
+
+    f = ys->active_frame;
+
+    if ((cache = search_index(f->buffer)) == NULL) {
+        yed_cerr("no search");
+        return;
+    }
+    if (array_len(cache->matches) == 0) {
+        yed_cerr("no matches for '%s'", cache->search);
+        return;
+    }
+
+    /* The index is already sorted and non-overlapping. */
+    array_clear(cache->sels);
+    array_traverse(cache->matches, m) {
+        sel.row1 = sel.row2 = m->row;
+        sel.col1 = m->col;
+        sel.col2 = m->end_col;
+        array_push(cache->sels, sel);
+    }
+
+    visual = 0;
+    XEXE(CMD_SELECT_OFF);
+    place_cursor(cache);
+    request_redraw();
+}
+
+/*
+ * Chunked d, y, and p.  When a selection (or the yank buffer, for p)
+ * spans xul-chunked-op-lines lines or more, the operator is run a
+ * slice at a time from EVENT_PRE_PUMP instead of all at once, so the
+ * editor keeps drawing.  Lines are first copied to *yank, then (for d)
+ * deleted from the last one up, so a range that reaches the end of the
+ * buffer doesn't move the lines after it.  Changes go into one undo
+ * record that stays open until the end.  xul-progress shows how far
+ * along it is, CTRL_C cancels (undoing what was changed), and other
+ * keys are ignored until it is done.  The update rate is raised while
+ * it runs, so that it gets pumped with no input, and put back after.
+ */
+#define CHUNK_NS        (8000000ULL) /* work per pump */
+#define CHUNK_ROWS      (256)        /* rows between clock checks */
+#define CHUNK_UPDATE_HZ (100)
+
+static int chunk_threshold(void) {
+    char *s;
+    int   lines;
+
+    if (macro_depth || repeating)                                { return 0; }
+    if ((s = yed_get_var("xul-chunked-op-lines")) == NULL)       { return 0; }
+    if (sscanf(s, "%d", &lines) != 1 || lines <= 0)              { return 0; }
+
+    return lines;
+}
+
+/* Text of rows a..b of a range, with a newline in front if lead_nl. */
+static char *chunk_text(yed_buffer *buff, int a, int b, int row1, int col1, int row2, int col2, int lead_nl) {
+    array_t   text;
+    yed_line *line;
+    int       row;
+    int       start;
+    int       end;
+    char      nl;
+
+    text = array_make(char);
+    nl   = '\n';
+
+    for (row = a; row <= b; row += 1) {
+        if ((line = yed_buff_get_line(buff, row)) == NULL) { break; }
+
+        start = row == row1 ? col_idx(line, col1) : 0;
+        end   = row == row2 ? col_idx(line, col2) : array_len(line->glyphs);
+
+        if (row > a || lead_nl) { array_push(text, nl); }
+        if (end > start)        { array_push_n(text, (char*)array_data(line->glyphs) + start, end - start); }
+    }
+
+    array_zero_term(text);
+
+    return array_data(text);
+}
+
+static void chunk_progress(int done, int total) {
+    char buff[64];
+    char op;
+
+    op = chunked.op;
+    snprintf(buff, sizeof(buff), "%c %d%%", op, total ? (int)((100LL * done) / total) : 100);
+    yed_set_var("xul-progress", buff);
+}
+
+static void chunk_stop(void) {
+    chunked.op = 0;
+    yed_unset_var("xul-progress");
+    if (ys->update_hz != chunked.save_hz) {
+        yed_set_update_hz(chunked.save_hz);
+    }
+    request_redraw();
+}
+
+/* The job's frame, if it still shows the job's buffer. */
+static yed_frame *chunk_frame(void) {
+    if (chunked.frame != NULL && chunked.frame->buffer == chunked.buffer) {
+        return chunked.frame;
+    }
+    return NULL;
+}
+
+static void chunk_finish(void) {
+    chunk_stop();
+
+    if (mode == MODE_NORMAL && chunked.frame == ys->active_frame) {
+        XEXE(CMD_SELECT_OFF);
+        select_cursor_line();
+    }
+}
+
+static void chunk_end(void) {
+    yed_frame *f;
+    int        op;
+    int        n;
+
+    f  = chunk_frame();
+    op = chunked.op;
+    n  = chunked.row2 - chunked.row1 + 1;
+
+    if (chunked.undo) {
+        yed_end_undo_record(chunked.frame, chunked.buffer);
+    }
+
+    /* If the frame has moved on to another buffer, its cursor is left alone. */
+    if (f != NULL && op == 'd') {
+        yed_set_cursor_within_frame(f, chunked.row1, chunked.col1);
+    } else if (f != NULL && op == 'p') {
+        if (chunked.yank->flags & BUFF_YANK_LINES) {
+            yed_set_cursor_within_frame(f, chunked.row1 + 1, 1);
+        } else {
+            yed_set_cursor_within_frame(f, chunked.p_row, chunked.p_col);
         }
-        i += 1;
     }
 
-    if (i == array_len(mode_bindings[b_mode])) { return; }
+    chunk_finish();
 
-    if (b_mode == mode) {
-        array_traverse(mode_bindings[mode], b) {
-            yed_unbind_key(b->key);
-            if (b->len > 1) {
-                yed_delete_key_sequence(b->key);
-            }
+    yed_cprint("%s %d lines", op == 'd' ? "deleted" : op == 'y' ? "yanked" : "pasted", n);
+}
+
+static void chunk_cancel(void) {
+    yed_frame *f;
+    int        op;
+
+    f  = chunk_frame();
+    op = chunked.op;
+
+    if (chunked.undo) {
+        /* Focus may have moved since; undo where the job was. */
+        yed_end_undo_record(chunked.frame, chunked.buffer);
+        yed_undo(f, chunked.buffer);
+    }
+
+    /* A yank that was cut short would be a surprise to paste. */
+    if (chunked.phase == CHUNK_COPY) {
+        yed_buff_clear_no_undo(chunked.yank);
+    }
+
+    if (op != 'y' && f != NULL) {
+        yed_set_cursor_within_frame(f, chunked.row1, chunked.col1);
+    }
+    chunk_finish();
+
+    yed_cprint("%c cancelled", op);
+}
+
+/* Copy rows to the end of *yank. */
+static void chunk_copy(int n) {
+    yed_line *last;
+    char     *text;
+    int       b;
+
+    b = chunked.next + n - 1;
+    if (b > chunked.row2) { b = chunked.row2; }
+
+    text = chunk_text(chunked.buffer, chunked.next, b,
+                      chunked.row1, chunked.col1, chunked.row2, chunked.col2,
+                      chunked.next > chunked.row1);
+    last = yed_buff_get_line(chunked.yank, yed_buff_n_lines(chunked.yank));
+    yed_buff_insert_string_no_undo(chunked.yank, text, yed_buff_n_lines(chunked.yank), last->visual_width + 1);
+    free(text);
+
+    chunked.next = b + 1;
+}
+
+/* Delete rows from the end of the range up; the first row is joined last. */
+static void chunk_delete(int n) {
+    int row;
+
+    for (; n > 0 && chunked.next > 0; n -= 1, chunked.next -= 1) {
+        row = chunked.row1 + chunked.next - 1;
+
+        if (chunked.kind == RANGE_LINE) {
+            yed_buff_delete_line(chunked.buffer, row);
+        } else if (row > chunked.row1 + 1) {
+            yed_buff_delete_line(chunked.buffer, row - 1);
+        } else if (row == chunked.row1 + 1) {
+            /* What is left: the head of the first row and the tail of the last. */
+            delete_text(chunked.buffer, chunked.row1, chunked.col1, chunked.row1 + 1, chunked.col2);
+        } else if (chunked.row1 == chunked.row2) {
+            delete_text(chunked.buffer, chunked.row1, chunked.col1, chunked.row1, chunked.col2);
         }
+    }
+}
 
-        array_delete(mode_bindings[b_mode], i);
+/* Paste the next rows of *yank. */
+static void chunk_paste(int n) {
+    yed_line *last;
+    char     *text;
+    int       b;
+    int       n_yank;
 
-        array_traverse(mode_bindings[mode], b) {
-            if (b->len > 1) {
-                b->key = yed_plugin_add_key_sequence(Self, b->len, b->keys);
-            } else {
-                b->key = b->keys[0];
-            }
+    n_yank = yed_buff_n_lines(chunked.yank);
+    last   = yed_buff_get_line(chunked.yank, n_yank);
+
+    b = chunked.next + n - 1;
+    if (b > n_yank) { b = n_yank; }
+
+    text = chunk_text(chunked.yank, chunked.next, b,
+                      1, 1, n_yank, last->visual_width + 1,
+                      chunked.next > 1 || (chunked.yank->flags & BUFF_YANK_LINES));
+    insert_text(chunked.buffer, chunked.p_row, chunked.p_col, text, &chunked.p_row, &chunked.p_col);
+    free(text);
 
-            yed_plugin_bind_key(Self, b->key, b->cmd, b->n_args, b->args);
+    chunked.next = b + 1;
+}
+
+static void chunk_step(void) {
+    unsigned long long start;
+    int                total;
+
+    start = now_ns();
+
+    do {
+        switch (chunked.phase) {
+            case CHUNK_COPY:
+                chunk_copy(CHUNK_ROWS);
+                if (chunked.next <= chunked.row2) { break; }
+
+                if (chunked.op == 'y') {
+                    chunk_end();
+                    return;
+                }
+
+                chunked.phase = CHUNK_DELETE;
+                chunked.next  = chunked.row2 - chunked.row1 + 1;
+                chunked.undo  = 1;
+                yed_start_undo_record(chunked.frame, chunked.buffer);
+                break;
+
+            case CHUNK_DELETE:
+                chunk_delete(CHUNK_ROWS);
+                if (chunked.next == 0) {
+                    chunk_end();
+                    return;
+                }
+                break;
+
+            case CHUNK_PASTE:
+                chunk_paste(CHUNK_ROWS);
+                if (chunked.next > yed_buff_n_lines(chunked.yank)) {
+                    chunk_end();
+                    return;
+                }
+                break;
         }
-    } else {
-        array_delete(mode_bindings[b_mode], i);
+    } while (now_ns() - start < CHUNK_NS);
+
+    /* Copying is the first half of d, deleting the second. */
+    total = chunked.row2 - chunked.row1 + 1;
+    switch (chunked.phase) {
+        case CHUNK_COPY:
+            chunk_progress(chunked.next - chunked.row1, chunked.op == 'd' ? 2 * total : total);
+            break;
+        case CHUNK_DELETE:
+            chunk_progress(2 * total - chunked.next, 2 * total);
+            break;
+        case CHUNK_PASTE:
+            chunk_progress(chunked.next - 1, yed_buff_n_lines(chunked.yank));
+            break;
     }
 }
 
-void xul_exit_insert(int n_args, char **args) {
-    change_mode(MODE_NORMAL);
+static void chunk_start(int op, int phase) {
+    chunked.op    = op;
+    chunked.phase = phase;
+    chunked.undo  = 0;
+
+    visual = 0;
+    XEXE(CMD_SELECT_OFF);
+
+    chunk_progress(0, 1);
+
+    chunked.save_hz = ys->update_hz;
+    if (ys->update_hz < CHUNK_UPDATE_HZ) {
+        yed_set_update_hz(CHUNK_UPDATE_HZ);
+    }
 }
 
-static void do_till_fw(int key) {
+/* d or y on the current selection, if it is big enough. */
+static int start_chunked(int op) {
     yed_frame *f;
+    yed_range *r;
+    int        min;
     yed_line  *line;
-    int        col;
-    yed_glyph *g;
 
-    if (!ys->active_frame || !ys->active_frame->buffer)    { goto out; }
+    if ((min = chunk_threshold()) == 0)                                     { return 0; }
+    if (!ys->active_frame || !ys->active_frame->buffer)                     { return 0; }
 
     f = ys->active_frame;
+    r = &f->buffer->selection;
 
-    line = yed_buff_get_line(f->buffer, f->cursor_line);
+    if (!f->buffer->has_selection || r->kind == RANGE_RECT)                 { return 0; }
+    if (abs(r->cursor_row - r->anchor_row) + 1 < min)                       { return 0; }
+    if ((chunked.yank = yed_get_buffer("*yank")) == NULL)                   { return 0; }
 
-    if (!line)    { goto out; }
+    chunked.frame  = f;
+    chunked.buffer = f->buffer;
+    chunked.kind   = r->kind;
 
-    for (col = f->cursor_col + 1; col <= line->visual_width; ) {
-        g = yed_line_col_to_glyph(line, col);
-        if (g->c == key) {
-            yed_set_cursor_within_frame(f, f->cursor_line, col);
-            break;
-        }
-        col += yed_get_glyph_width(g);
+    if (pos_cmp(r->anchor_row, r->anchor_col, r->cursor_row, r->cursor_col) <= 0) {
+        chunked.row1 = r->anchor_row; chunked.col1 = r->anchor_col;
+        chunked.row2 = r->cursor_row; chunked.col2 = r->cursor_col;
+    } else {
+        chunked.row1 = r->cursor_row; chunked.col1 = r->cursor_col;
+        chunked.row2 = r->anchor_row; chunked.col2 = r->anchor_col;
     }
 
-    last_till_key = key;
+    if (r->kind == RANGE_LINE) {
+        line         = yed_buff_get_line(f->buffer, chunked.row2);
+        chunked.col1 = 1;
+        chunked.col2 = line ? line->visual_width + 1 : 1;
+    }
 
-out:
-    till_pending = 0;
-    return;
+    yed_buff_clear_no_undo(chunked.yank);
+    if (r->kind == RANGE_LINE) {
+        chunked.yank->flags |= BUFF_YANK_LINES;
+    } else {
+        chunked.yank->flags &= ~BUFF_YANK_LINES;
+    }
+
+    chunked.next = chunked.row1;
+    chunk_start(op, CHUNK_COPY);
+
+    return 1;
 }
 
-static void do_till_bw(int key, int stop_before) {
-    yed_frame *f;
-    yed_line  *line;
-    int        col;
-    yed_glyph *g;
+/* p of a big enough yank. */
+static int start_chunked_paste(void) {
+    yed_frame  *f;
+    yed_buffer *yank;
+    yed_line   *line;
+    int         min;
 
-    if (!ys->active_frame || !ys->active_frame->buffer)    { goto out; }
+    if ((min = chunk_threshold()) == 0)                                     { return 0; }
+    if (!ys->active_frame || !ys->active_frame->buffer)                     { return 0; }
+    if ((yank = yed_get_buffer("*yank")) == NULL)                           { return 0; }
+    if (yed_buff_n_lines(yank) < min)                                       { return 0; }
 
     f = ys->active_frame;
 
-    line = yed_buff_get_line(f->buffer, f->cursor_line);
+    chunked.frame  = f;
+    chunked.buffer = f->buffer;
+    chunked.yank   = yank;
+    chunked.row1   = chunked.row2 = f->cursor_line;
+    chunked.col1   = f->cursor_col;
+    chunked.next   = 1;
+    chunked.p_row  = f->cursor_line;
+    chunked.p_col  = f->cursor_col;
+
+    if (yank->flags & BUFF_YANK_LINES) {
+        /* Lines go in below the cursor line. */
+        line          = yed_buff_get_line(f->buffer, f->cursor_line);
+        chunked.p_col = line ? line->visual_width + 1 : 1;
+    }
 
-    if (!line)    { goto out; }
+    chunk_start('p', CHUNK_PASTE);
 
-    for (col = f->cursor_col - 1; col >= 1;) {
-        g = yed_line_col_to_glyph(line, col);
-        if (g == NULL) { break; }
-        if (g->c == key) {
-            yed_set_cursor_within_frame(f,
-                                        f->cursor_line,
-                                        col + (stop_before * yed_get_glyph_width(g)));
-            break;
-        }
-        if (col == 1) { break; } /* Didn't find it. Prevent endless loop. */
-        col = yed_line_idx_to_col(line, yed_line_col_to_idx(line, col - 1));
+    chunked.row2  = chunked.row1 + yed_buff_n_lines(yank) - 1;
+    chunked.undo  = 1;
+    yed_start_undo_record(f, f->buffer);
+
+    return 1;
+}
+
+void epump(yed_event *event) {
+    if (chunked.op) {
+        chunk_step();
+    } else if (seq_node != NULL) {
+        seq_timeout();
     }
+}
 
-    last_till_key = key;
+/*
+ * Regex selection: s (select the matches in each selection), S (split
+ * each selection on the matches), and the keep/drop filters.  Patterns
+ * are POSIX extended regexes matched within a line; with no argument
+ * the current search is used.
+ *
+ * The lines are cut into chunks that a pool of worker threads matches
+ * in parallel with the main thread, each into its own output, and the
+ * results are merged back in order on the main thread.  glibc's
+ * regexec() locks the compiled pattern, so every thread gets its own
+ * compiled copy; compiled patterns are cached by pattern string.
+ */
+#define MAX_WORKERS      (32)
+#define REGEX_CACHE_SIZE (16)
+#define REGEX_CHUNK      (4096)
 
-out:
-    till_pending = 0;
-    return;
+typedef struct {
+    char               *pattern;
+    int                 n_compiled;
+    regex_t             re[MAX_WORKERS + 1]; /* [0] for the main thread */
+    unsigned long long  last_use;
+} regex_entry;
+
+/* The part of one line that lies in one selection. */
+typedef struct {
+    int         sel;
+    int         row;
+    const char *data;
+    int         start;
+    int         end;
+    int         len; /* of the whole line */
+} regex_seg;
+
+typedef struct {
+    int seg;
+    int so;
+    int eo;
+} regex_hit;
+
+enum {
+    REGEX_SELECT,
+    REGEX_SPLIT,
+    REGEX_KEEP,
+    REGEX_DROP,
+};
+
+typedef struct {
+    regex_entry *entry;
+    int          op;
+    regex_seg   *segs;
+    int          n_segs;
+    int          n_chunks;
+    array_t     *chunk_hits; /* regex_hit, one array per chunk (select/split) */
+    char        *seg_hit;    /* one flag per seg (keep/drop) */
+} regex_job;
+
+static regex_entry        regex_cache[REGEX_CACHE_SIZE];
+static unsigned long long regex_clock;
+
+static struct {
+    int              started;
+    int              n_threads;
+    pthread_t        threads[MAX_WORKERS];
+    pthread_mutex_t  lock;
+    pthread_cond_t   work_cond;
+    pthread_cond_t   done_cond;
+    unsigned         generation;
+    int              quit;
+    regex_job       *job;
+    int              next_chunk;
+    int              chunks_done;
+} pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .work_cond = PTHREAD_COND_INITIALIZER, .done_cond = PTHREAD_COND_INITIALIZER };
+
+static int n_workers(void) {
+    long n;
+
+    if (pool.started) { return pool.n_threads; }
+
+    n = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+
+    if (n < 0)           { n = 0;           }
+    if (n > MAX_WORKERS) { n = MAX_WORKERS; }
+
+    return n;
 }
 
-int nav_common(int key) {
-    int has_sel;
-    int is_line_sel;
-    int save_cursor_line;
+static regex_entry *get_regex(const char *pattern) {
+    regex_entry *e;
+    regex_entry *victim;
+    int          i;
+    int          err;
+    char         msg[256];
 
-    if (till_pending == 1) {
-        do_till_fw(key);
-        goto out;
-    } else if (till_pending > 1) {
-        do_till_bw(key, till_pending == 3);
-        goto out;
+    victim = &regex_cache[0];
+
+    for (i = 0; i < REGEX_CACHE_SIZE; i += 1) {
+        e = &regex_cache[i];
+        if (e->pattern != NULL && strcmp(e->pattern, pattern) == 0) {
+            e->last_use = ++regex_clock;
+            return e;
+        }
+        if (e->last_use < victim->last_use) { victim = e; }
     }
 
-    has_sel     =     ys->active_frame
-                   && ys->active_frame->buffer
-                   && ys->active_frame->buffer->has_selection;
+    e = victim;
 
-    is_line_sel =     has_sel
-                   && ys->active_frame->buffer->selection.kind == RANGE_LINE;
+    for (i = 0; i < e->n_compiled; i += 1) {
+        regfree(&e->re[i]);
+    }
+    free(e->pattern);
+    e->pattern    = NULL;
+    e->n_compiled = 0;
+    e->last_use   = 0;
+
+    if ((err = regcomp(&e->re[0], pattern, REG_EXTENDED)) != 0) {
+        regerror(err, &e->re[0], msg, sizeof(msg));
+        regfree(&e->re[0]);
+        yed_cerr("bad regex '%s': %s", pattern, msg);
+        return NULL;
+    }
 
-    if (!has_sel) {
-        YEXE("select-lines");
+    for (i = 1; i <= n_workers(); i += 1) {
+        regcomp(&e->re[i], pattern, REG_EXTENDED);
     }
 
-    switch (key) {
-        case 'h':
-        case ARROW_LEFT:
-            if (!visual) {
-                YEXE("select-off");
-                YEXE("select");
-            }
-            YEXE("cursor-left");
-            break;
-        case 'H':
-            if (!visual && is_line_sel) {
-                YEXE("select-off");
-                YEXE("select");
-            }
-            YEXE("cursor-left");
-            break;
+    e->n_compiled = i;
+    e->pattern    = strdup(pattern);
+    e->last_use   = ++regex_clock;
 
-        case 'j':
-        case ARROW_DOWN:
-            if (visual) {
-                YEXE("cursor-down");
-            } else {
-                YEXE("select-off");
-                YEXE("cursor-down");
-                YEXE("select-lines");
+    return e;
+}
+
+void free_regex_cache(void) {
+    int i;
+    int j;
+
+    for (i = 0; i < REGEX_CACHE_SIZE; i += 1) {
+        for (j = 0; j < regex_cache[i].n_compiled; j += 1) {
+            regfree(&regex_cache[i].re[j]);
+        }
+        free(regex_cache[i].pattern);
+        memset(&regex_cache[i], 0, sizeof(regex_cache[i]));
+    }
+}
+
+static void run_regex_chunk(regex_job *job, int chunk, int slot) {
+    regex_t    *re;
+    regex_seg  *seg;
+    regmatch_t  m;
+    regex_hit   hit;
+    int         i;
+    int         end;
+    int         flags;
+
+    re  = &job->entry->re[slot];
+    i   = chunk * REGEX_CHUNK;
+    end = i + REGEX_CHUNK < job->n_segs ? i + REGEX_CHUNK : job->n_segs;
+
+    for (; i < end; i += 1) {
+        seg      = &job->segs[i];
+        m.rm_so  = seg->start;
+        m.rm_eo  = seg->end;
+        /* '$' only matches where the line really ends. */
+        flags    = REG_STARTEND | (seg->end < seg->len ? REG_NOTEOL : 0);
+
+        while (m.rm_so <= seg->end && regexec(re, seg->data, 1, &m, flags) == 0) {
+            if (job->op == REGEX_KEEP || job->op == REGEX_DROP) {
+                job->seg_hit[i] = 1;
+                break;
             }
-            break;
-        case 'J':
-            YEXE("cursor-down");
-            break;
 
-        case 'k':
-        case ARROW_UP:
-            if (visual) {
-                YEXE("cursor-up");
+            if (m.rm_eo > m.rm_so) {
+                hit.seg = i;
+                hit.so  = m.rm_so;
+                hit.eo  = m.rm_eo;
+                array_push(job->chunk_hits[chunk], hit);
+                m.rm_so = m.rm_eo;
             } else {
-                YEXE("select-off");
-                YEXE("cursor-up");
-                YEXE("select-lines");
+                /* Empty match: step past the glyph it is in front of. */
+                if (m.rm_so >= seg->end) { break; }
+                m.rm_so += yed_get_glyph_len((yed_glyph*)(seg->data + m.rm_so));
             }
-            break;
-        case 'K':
-            YEXE("cursor-up");
-            break;
+            m.rm_eo = seg->end;
+        }
+    }
+}
 
-        case 'l':
-        case ARROW_RIGHT:
-            if (!visual) {
-                YEXE("select-off");
-                YEXE("select");
-            }
-        case 'L':
-            if (!visual && is_line_sel) {
-                YEXE("select-off");
-                YEXE("select");
-            }
-            YEXE("cursor-right");
-            break;
+static void *regex_worker(void *arg) {
+    int        slot;
+    unsigned   seen;
+    regex_job *job;
+    int        chunk;
 
-        case PAGE_UP:
-            if (visual) {
-                YEXE("cursor-page-up");
-            } else {
-                YEXE("select-off");
-                YEXE("cursor-page-up");
-                YEXE("select-lines");
+    slot = (int)(long)arg;
+    seen = 0;
+
+    pthread_mutex_lock(&pool.lock);
+
+    for (;;) {
+        while (!pool.quit && pool.generation == seen) {
+            pthread_cond_wait(&pool.work_cond, &pool.lock);
+        }
+
+        if (pool.quit) { break; }
+
+        seen = pool.generation;
+        job  = pool.job;
+
+        /* The main thread may have finished the job on its own already. */
+        if (job == NULL) { continue; }
+
+        while (pool.next_chunk < job->n_chunks) {
+            chunk            = pool.next_chunk;
+            pool.next_chunk += 1;
+
+            pthread_mutex_unlock(&pool.lock);
+            run_regex_chunk(job, chunk, slot);
+            pthread_mutex_lock(&pool.lock);
+
+            pool.chunks_done += 1;
+            if (pool.chunks_done == job->n_chunks) {
+                pthread_cond_signal(&pool.done_cond);
             }
+        }
+    }
+
+    pthread_mutex_unlock(&pool.lock);
+
+    return NULL;
+}
+
+static void start_workers(void) {
+    int i;
+
+    if (pool.started) { return; }
+
+    pool.n_threads = n_workers();
+    pool.quit      = 0;
+
+    for (i = 0; i < pool.n_threads; i += 1) {
+        if (pthread_create(&pool.threads[i], NULL, regex_worker, (void*)(long)(i + 1)) != 0) {
             break;
+        }
+    }
+
+    pool.n_threads = i;
+    pool.started   = 1;
+}
+
+void stop_workers(void) {
+    int i;
+
+    if (!pool.started) { return; }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.quit = 1;
+    pthread_cond_broadcast(&pool.work_cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (i = 0; i < pool.n_threads; i += 1) {
+        pthread_join(pool.threads[i], NULL);
+    }
+
+    pool.started   = 0;
+    pool.n_threads = 0;
+}
+
+/* Run every chunk of the job, on the pool when there is more than one. */
+static void run_regex_job(regex_job *job) {
+    int chunk;
+
+    if (job->n_chunks <= 1) {
+        for (chunk = 0; chunk < job->n_chunks; chunk += 1) {
+            run_regex_chunk(job, chunk, 0);
+        }
+        return;
+    }
+
+    start_workers();
+
+    pthread_mutex_lock(&pool.lock);
+
+    pool.job          = job;
+    pool.next_chunk   = 0;
+    pool.chunks_done  = 0;
+    pool.generation  += 1;
+    pthread_cond_broadcast(&pool.work_cond);
+
+    /* The main thread takes chunks too. */
+    while (pool.next_chunk < job->n_chunks) {
+        chunk            = pool.next_chunk;
+        pool.next_chunk += 1;
+
+        pthread_mutex_unlock(&pool.lock);
+        run_regex_chunk(job, chunk, 0);
+        pthread_mutex_lock(&pool.lock);
+
+        pool.chunks_done += 1;
+    }
+
+    while (pool.chunks_done < job->n_chunks) {
+        pthread_cond_wait(&pool.done_cond, &pool.lock);
+    }
+
+    pool.job = NULL;
+
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/*
+ * The selections to work on: the multiple selections, or else yed's
+ * selection as one range (or one range per line, for the filters).
+ */
+static int source_sels(buffer_cache *cache, int per_line) {
+    yed_buffer *buff;
+    yed_range  *r;
+    yed_line   *line;
+    xsel        sel;
+    xsel        lsel;
+    int         row;
+
+    if (array_len(cache->sels)) { return 1; }
+
+    buff = cache->buffer;
+
+    if (ys->active_frame && buff == ys->active_frame->buffer) {
+        materialize_line_sel();
+    }
+
+    if (!buff->has_selection) { return 0; }
+
+    r = &buff->selection;
+
+    if (pos_cmp(r->anchor_row, r->anchor_col, r->cursor_row, r->cursor_col) <= 0) {
+        sel.row1 = r->anchor_row; sel.col1 = r->anchor_col;
+        sel.row2 = r->cursor_row; sel.col2 = r->cursor_col;
+    } else {
+        sel.row1 = r->cursor_row; sel.col1 = r->cursor_col;
+        sel.row2 = r->anchor_row; sel.col2 = r->anchor_col;
+    }
+
+    if (r->kind == RANGE_LINE) {
+        line     = yed_buff_get_line(buff, sel.row2);
+        sel.col1 = 1;
+        sel.col2 = line ? line->visual_width + 1 : 1;
+    }
+
+    if (!per_line) {
+        array_push(cache->sels, sel);
+        return 1;
+    }
+
+    for (row = sel.row1; row <= sel.row2; row += 1) {
+        line      = yed_buff_get_line(buff, row);
+        lsel.row1 = lsel.row2 = row;
+        lsel.col1 = row == sel.row1 ? sel.col1 : 1;
+        lsel.col2 = row == sel.row2 ? sel.col2 : (line ? line->visual_width + 1 : 1);
+        array_push(cache->sels, lsel);
+    }
+
+    return 1;
+}
+
+/* The pieces of each selection between the matches in it. */
+static void split_sels(regex_job *job, yed_buffer *buff, xsel *sels, int n, array_t *out) {
+    int        i;
+    int        chunk;
+    int        k;
+    regex_hit *hit;
+    yed_line  *line;
+    xsel       piece;
 
-        case PAGE_DOWN:
-            if (visual) {
-                YEXE("cursor-page-up");
-            } else {
-                YEXE("select-off");
-                YEXE("cursor-page-down");
-                YEXE("select-lines");
-            }
-            break;
+    chunk = 0;
+    k     = 0;
 
-        case 'w':
-            if (!visual) {
-                YEXE("select-off");
-                YEXE("select");
-            }
-        case 'W':
-            if (!visual && is_line_sel) {
-                YEXE("select-off");
-                YEXE("select");
-            }
-            YEXE("cursor-next-word");
-            break;
+    for (i = 0; i < n; i += 1) {
+        piece.row1 = sels[i].row1;
+        piece.col1 = sels[i].col1;
 
-        case 'b':
-            if (!visual) {
-                YEXE("select-off");
-                YEXE("select");
-            }
-        case 'B':
-            if (!visual && is_line_sel) {
-                YEXE("select-off");
-                YEXE("select");
+        for (;;) {
+            while (chunk < job->n_chunks && k >= array_len(job->chunk_hits[chunk])) {
+                chunk += 1;
+                k      = 0;
             }
-            YEXE("cursor-prev-word");
-            break;
+            if (chunk == job->n_chunks) { break; }
 
-        case '0':
-        case HOME_KEY:
-            if (!visual) {
-                YEXE("select-off");
-                YEXE("select");
-            }
-            YEXE("cursor-line-begin");
-            break;
+            hit = array_item(job->chunk_hits[chunk], k);
+            if (job->segs[hit->seg].sel != i) { break; }
+            k += 1;
 
-        case '$':
-        case END_KEY:
-            if (!visual) {
-                YEXE("select-off");
-                YEXE("select");
+            line       = yed_buff_get_line(buff, job->segs[hit->seg].row);
+            piece.row2 = job->segs[hit->seg].row;
+            piece.col2 = idx_col(line, hit->so);
+            if (pos_cmp(piece.row1, piece.col1, piece.row2, piece.col2) < 0) {
+                array_push(*out, piece);
             }
-            YEXE("cursor-line-end");
-            break;
+            piece.row1 = piece.row2;
+            piece.col1 = idx_col(line, hit->eo);
+        }
 
-        case '{':
-            if (!visual) {
-                YEXE("select-off");
-                YEXE("select-lines");
-            }
-            save_cursor_line = ys->active_frame ? ys->active_frame->cursor_line : 0;
-            YEXE("cursor-up");
-            YEXE("cursor-prev-paragraph");
-            YEXE("cursor-next-paragraph");
-            YEXE("cursor-up");
-            if ((ys->active_frame ? ys->active_frame->cursor_line : 0) == save_cursor_line) {
-                YEXE("cursor-up");
-            }
-            break;
+        piece.row2 = sels[i].row2;
+        piece.col2 = sels[i].col2;
+        if (pos_cmp(piece.row1, piece.col1, piece.row2, piece.col2) < 0) {
+            array_push(*out, piece);
+        }
+    }
+}
 
-        case '}':
-            if (!visual) {
-                YEXE("select-off");
-                YEXE("select-lines");
-            }
-            save_cursor_line = ys->active_frame ? ys->active_frame->cursor_line : 0;
-            YEXE("cursor-next-paragraph");
-            YEXE("cursor-up");
-            if ((ys->active_frame ? ys->active_frame->cursor_line : 0) == save_cursor_line) {
-                YEXE("cursor-down");
-                YEXE("cursor-next-paragraph");
-                YEXE("cursor-up");
-            }
-            break;
+static void regex_sels(int op, int n_args, char **args) {
+    yed_frame    *f;
+    buffer_cache *cache;
+    regex_entry  *entry;
+    regex_job     job;
+    array_t       segs;
+    array_t       out;
+    array_t       pattern;
+    regex_seg     seg;
+    regex_hit    *hit;
+    xsel         *sels;
+    xsel          sel;
+    yed_line     *line;
+    int           n;
+    int           i;
+    int           j;
+    int           row;
+    int           keep;
+    int           had_sels;
+    char          space;
+
+    if (!ys->active_frame || !ys->active_frame->buffer) {
+        yed_cerr("no active buffer");
+        return;
+    }
 
-        case 'g':
-            YEXE("cursor-buffer-begin");
-            if (!visual) {
-                YEXE("select-off");
-                YEXE("select-lines");
-            }
-            break;
+    f = ys->active_frame;
 
-        case 'G':
-            YEXE("cursor-buffer-end");
-            if (!visual) {
-                YEXE("select-off");
-                YEXE("select-lines");
-            }
-            break;
+    space   = ' ';
+    pattern = array_make(char);
+    for (i = 0; i < n_args; i += 1) {
+        if (i) { array_push(pattern, space); }
+        array_push_n(pattern, args[i], strlen(args[i]));
+    }
+    if (n_args == 0 && ys->current_search != NULL) {
+        array_push_n(pattern, ys->current_search, strlen(ys->current_search));
+    }
+    array_zero_term(pattern);
 
-        case '/':
-            if (!visual) {
-                YEXE("select-off");
-                YEXE("select");
-            }
-            save_cursor_line = ys->active_frame ? ys->active_frame->cursor_line : 0;
-            YEXE("find-in-buffer");
-            if ((ys->active_frame ? ys->active_frame->cursor_line : 0) != save_cursor_line) {
-                YEXE("select-off");
-            }
-            break;
+    if (array_len(pattern) == 0) {
+        yed_cerr("no pattern and no search");
+        array_free(pattern);
+        return;
+    }
 
-        case '?':
-            YEXE("replace-current-search");
-            break;
+    entry = get_regex(array_data(pattern));
+    array_free(pattern);
 
-        case 'n':
-            if (!visual) {
-                YEXE("select-off");
-                YEXE("select");
-            }
-            save_cursor_line = ys->active_frame ? ys->active_frame->cursor_line : 0;
-            YEXE("find-next-in-buffer");
-            if ((ys->active_frame ? ys->active_frame->cursor_line : 0) != save_cursor_line) {
-                YEXE("select-off");
-                YEXE("select-lines");
-            }
-            break;
+    if (entry == NULL) { return; }
 
-        case 'N':
-            if (!visual) {
-                YEXE("select-off");
-                YEXE("select");
-            }
-            save_cursor_line = ys->active_frame ? ys->active_frame->cursor_line : 0;
-            YEXE("find-prev-in-buffer");
-            if ((ys->active_frame ? ys->active_frame->cursor_line : 0) != save_cursor_line) {
-                YEXE("select-off");
-                YEXE("select-lines");
-            }
-            break;
+    cache    = get_buffer_cache(f->buffer);
+    had_sels = array_len(cache->sels);
 
-        case 'f':
-        case 't':
-            if (!visual) {
-                YEXE("select-off");
-                YEXE("select");
-            }
-            till_pending = 1;
-            last_till_op = key;
-            break;
+    if (!source_sels(cache, op == REGEX_KEEP || op == REGEX_DROP)) {
+        yed_cerr("nothing selected");
+        return;
+    }
 
-        case 'F':
-        case 'T':
-            if (!visual) {
-                YEXE("select-off");
-                YEXE("select");
-            }
-            till_pending = 2 + (key == 'T');
-            last_till_op = key;
-            break;
+    sels = array_data(cache->sels);
+    n    = array_len(cache->sels);
+    segs = array_make(regex_seg);
+
+    for (i = 0; i < n; i += 1) {
+        for (row = sels[i].row1; row <= sels[i].row2; row += 1) {
+            if ((line = yed_buff_get_line(f->buffer, row)) == NULL) { break; }
+
+            seg.sel   = i;
+            seg.row   = row;
+            seg.data  = array_data(line->glyphs);
+            seg.start = row == sels[i].row1 ? col_idx(line, sels[i].col1) : 0;
+            seg.end   = row == sels[i].row2 ? col_idx(line, sels[i].col2) : array_len(line->glyphs);
+            seg.len   = array_len(line->glyphs);
+            array_push(segs, seg);
+        }
+    }
 
-        case ';':
-            if (!visual) {
-                YEXE("select-off");
-                YEXE("select");
-            }
-            break;
+    memset(&job, 0, sizeof(job));
+    job.entry    = entry;
+    job.op       = op;
+    job.segs     = array_data(segs);
+    job.n_segs   = array_len(segs);
+    job.n_chunks = (job.n_segs + REGEX_CHUNK - 1) / REGEX_CHUNK;
 
-        default:
-            return 0;
+    if (op == REGEX_KEEP || op == REGEX_DROP) {
+        job.seg_hit = calloc(job.n_segs + 1, 1);
+    } else {
+        job.chunk_hits = malloc((job.n_chunks + 1) * sizeof(array_t));
+        for (i = 0; i < job.n_chunks; i += 1) {
+            job.chunk_hits[i] = array_make(regex_hit);
+        }
     }
 
-    if (isprint(key)) {
-        switch (key) {
-            case 'f':
-            case 'F':
-            case 't':
-            case 'T':
-                last_nav_key = key;
-                break;
-            default:
-                last_nav_key = tolower(key);
-                break;
+    run_regex_job(&job);
+
+    /* Merge, in order, into the new selections. */
+    out = array_make(xsel);
+
+    if (op == REGEX_KEEP || op == REGEX_DROP) {
+        for (i = 0, j = 0; i < n; i += 1) {
+            keep = 0;
+            for (; j < job.n_segs && job.segs[j].sel == i; j += 1) {
+                keep |= job.seg_hit[j];
+            }
+            if (keep == (op == REGEX_KEEP)) {
+                array_push(out, sels[i]);
+            }
+        }
+        free(job.seg_hit);
+    } else if (op == REGEX_SELECT) {
+        for (i = 0; i < job.n_chunks; i += 1) {
+            array_traverse(job.chunk_hits[i], hit) {
+                seg      = job.segs[hit->seg];
+                line     = yed_buff_get_line(f->buffer, seg.row);
+                sel.row1 = sel.row2 = seg.row;
+                sel.col1 = idx_col(line, hit->so);
+                sel.col2 = idx_col(line, hit->eo);
+                array_push(out, sel);
+            }
         }
     } else {
-        last_nav_key = key;
+        split_sels(&job, f->buffer, sels, n, &out);
     }
 
-out:;
-    return 1;
+    if (job.chunk_hits != NULL) {
+        for (i = 0; i < job.n_chunks; i += 1) {
+            array_free(job.chunk_hits[i]);
+        }
+        free(job.chunk_hits);
+    }
+
+    array_free(segs);
+
+    if (array_len(out) == 0) {
+        yed_cerr("no selections left");
+        array_free(out);
+        if (!had_sels) { array_clear(cache->sels); }
+        return;
+    }
+
+    array_free(cache->sels);
+    cache->sels = out;
+
+    visual = 0;
+    XEXE(CMD_SELECT_OFF);
+    normalize_sels(cache);
+    place_cursor(cache);
+}
+
+void xul_select_regex(int n_args, char **args) { regex_sels(REGEX_SELECT, n_args, args); }
+void xul_split_regex(int n_args, char **args)  { regex_sels(REGEX_SPLIT,  n_args, args); }
+void xul_keep_regex(int n_args, char **args)   { regex_sels(REGEX_KEEP,   n_args, args); }
+void xul_drop_regex(int n_args, char **args)   { regex_sels(REGEX_DROP,   n_args, args); }
+
+/* "viw", "va{", "vip": select a text object and stay in visual mode. */
+static void visual_text_object(int ia, int obj, int n) {
+    text_range r;
+
+    if (!text_object(ia, obj, n, &r)) { return; }
+
+    select_range(r.kind, r.row1, r.col1, r.row2, r.col2);
 }
 
 void normal(int key) {
-    int *key_it;
+    TRACE_BEGIN("normal");
+    _normal(key);
+    TRACE_END("normal");
+}
+
+static void _normal(int key) {
+    int           n;
+    int           typed;
+    int           i;
+    int           n_records;
+    buffer_cache *cache;
+    yed_buffer   *buff;
+
+    if (!till_pending
+    &&  !op_motion
+    &&  !textobj_pending
+    &&  !macro_pending
+    &&  isdigit(key)
+    &&  (key != '0' || count)) {
+        if (count < 100000000) {
+            count = (count * 10) + (key - '0');
+        }
+        return;
+    }
+
+    typed = count;
+    n     = count ? count : 1;
+
+    if (textobj_pending) {
+        count = 0;
+        visual_text_object(textobj_pending, key, n);
+        textobj_pending = 0;
+        return;
+    }
+
+    if (macro_pending) {
+        i             = macro_pending;
+        macro_pending = 0;
+        count         = 0;
+        macro_key(i, key, macro_count);
+        return;
+    }
+
+    if (op_pending) {
+        count = 0;
+        op_pending_key(key, typed);
+        return;
+    }
+
+    if ((cache = active_sels()) != NULL && multi_key(cache, key)) {
+        count = 0;
+        return;
+    }
 
-    if (nav_common(key)) {
+    if (nav_common(key, typed)) {
+        count = 0;
         return;
     }
 
+    count = 0;
+
     switch (key) {
         case 'c':
-            visual = 0;
-            YEXE("yank-selection", "1");
-            YEXE("delete-back");
-            YEXE("select-off");
-            change_mode(MODE_INSERT);
-            break;
         case 'd':
-            visual = 0;
-            YEXE("yank-selection", "1");
-            YEXE("delete-back");
-            YEXE("select-off");
-            YEXE("select-lines");
-            break;
-
         case 'y':
-            visual = 0;
-            YEXE("yank-selection");
-            YEXE("select-off");
-            YEXE("select-lines");
+            /*
+             * Operators act right away on a visual or walked (character)
+             * selection.  On the default line selection they wait for
+             * a motion: "dw", "d3j", "c}", "yt;", "dd".
+             */
+            if (visual
+            ||  (ys->active_frame
+              && ys->active_frame->buffer
+              && ys->active_frame->buffer->has_selection
+              && ys->active_frame->buffer->selection.kind != RANGE_LINE)) {
+
+                op_on_selection(key);
+                save_op_motion = 0;
+            } else {
+                op_pending = key;
+                op_count   = typed;
+                op_motion  = 0;
+                return;
+            }
             break;
 
         case 'v':
             visual = !visual;
-            YEXE("select-off");
-            YEXE("select");
+            XEXE(CMD_SELECT_OFF);
+            XEXE(CMD_SELECT);
             break;
 
         case 'V':
             visual = !visual;
-            YEXE("select-off");
-            YEXE("select-lines");
+            XEXE(CMD_SELECT_OFF);
+            XEXE(CMD_SELECT_LINES);
             break;
 
         case CTRL_V:
             visual = !visual;
-            YEXE("select-off");
-            YEXE("select-rect");
+            XEXE(CMD_SELECT_OFF);
+            XEXE(CMD_SELECT_RECT);
             break;
 
         case 'p':
             visual = 0;
-            YEXE("paste-yank-buffer");
-            YEXE("select-off");
-            YEXE("select-lines");
+            if (n == 1 && start_chunked_paste()) { break; }
+            materialize_line_sel();
+            for (i = 0; i < n; i += 1) {
+                XEXE(CMD_PASTE_YANK_BUFFER);
+            }
+            XEXE(CMD_SELECT_OFF);
+            select_cursor_line();
             break;
 
         case 'a':
-            YEXE("cursor-right");
+            if (visual) {
+                textobj_pending = key;
+                return;
+            }
+            XEXE(CMD_CURSOR_RIGHT);
             goto enter_insert;
         case 'A':
-            YEXE("cursor-line-end");
+            XEXE(CMD_CURSOR_LINE_END);
             goto enter_insert;
         case 'i':
+            if (visual) {
+                textobj_pending = key;
+                return;
+            }
 enter_insert:
             visual = 0;
-            YEXE("select-off");
+            XEXE(CMD_SELECT_OFF);
             change_mode(MODE_INSERT);
             break;
 
         case DEL_KEY:
-            YEXE("select-off");
-            YEXE("delete-forward");
+            XEXE(CMD_SELECT_OFF);
+            XEXE(CMD_DELETE_FORWARD);
             break;
 
         case 'u':
             visual = 0;
-            YEXE("undo");
-            YEXE("select-off");
-            YEXE("select-lines");
+            for (i = 0; i < n; i += 1) {
+                XEXE(CMD_UNDO);
+            }
+            XEXE(CMD_SELECT_OFF);
+            select_cursor_line();
             break;
 
         case CTRL_R:
             visual = 0;
-            YEXE("redo");
-            YEXE("select-off");
-            YEXE("select-lines");
+            for (i = 0; i < n; i += 1) {
+                XEXE(CMD_REDO);
+            }
+            XEXE(CMD_SELECT_OFF);
+            select_cursor_line();
             break;
 
         case '.':
@@ -904,34 +5873,87 @@ enter_insert:
             ||  save_action == 'A'
             ||  save_action == 'i') {
 
+                /* "500." is one insertion of the text 500 times over. */
                 normal(save_action);
-                array_traverse(insert_repeat_keys, key_it) {
-                    insert(*key_it);
-                }
+                replay_insert(n);
                 change_mode(MODE_NORMAL);
-            } else {
-                nav_common(save_nav_key);
-
-                if (save_nav_key == 'f' || save_nav_key == 'F'
-                ||  save_nav_key == 't' || save_nav_key == 'T') {
-
-                    nav_common(last_till_key);
+                repeating = 0;
+                break;
+            }
+            buff      = ys->active_frame ? ys->active_frame->buffer : NULL;
+            n_records = buff ? yed_get_undo_num_records(buff) : 0;
+            for (i = 0; i < n; i += 1) {
+                if (save_op_motion) {
+                    op_run(save_action, save_op_motion, save_op_count, save_op_till_key);
+                } else {
+                    nav_common(save_nav_key, save_nav_count);
+
+                    if (save_nav_key == 'f' || save_nav_key == 'F'
+                    ||  save_nav_key == 't' || save_nav_key == 'T') {
+
+                        nav_common(last_till_key, 1);
+                    }
+
+                    if (save_action == 'c' || save_action == 'd' || save_action == 'y') {
+                        op_on_selection(save_action);
+                    } else {
+                        normal(save_action);
+                    }
+                }
+                if (save_action == 'c' && mode == MODE_INSERT) {
+                    replay_insert(1);
+                    change_mode(MODE_NORMAL);
+                }
+            }
+            /* "3." is one change to undo, like "500." after an insert. */
+            if (buff != NULL && ys->active_frame && ys->active_frame->buffer == buff) {
+                while (yed_get_undo_num_records(buff) > n_records + 1) {
+                    yed_merge_undo_records(buff);
                 }
-
-                normal(save_action);
             }
             repeating = 0;
             break;
 
         case ':':
-            YEXE("command-prompt");
+            materialize_line_sel();
+            YEXE_COUNTED("command-prompt");
+            break;
+
+        case '*':
+            xul_select_matches(0, NULL);
+            break;
+
+        case 's':
+            xul_select_regex(0, NULL);
+            break;
+
+        case 'q':
+            if (macro_recording) {
+                /* This 'q' was recorded on the way in. */
+                if (!macro_depth) {
+                    array_pop(macro_regs[macro_recording - 1]);
+                }
+                macro_recording = 0;
+                yed_unset_var("xul-recording");
+                return;
+            }
+            macro_pending = key;
+            return;
+
+        case '@':
+            macro_pending = key;
+            macro_count   = n;
+            return;
+
+        case 'S':
+            xul_split_regex(0, NULL);
             break;
 
         case ESC:
         case CTRL_C:
             visual = 0;
-            YEXE("select-off");
-            YEXE("select-lines");
+            XEXE(CMD_SELECT_OFF);
+            select_cursor_line();
             break;
 
         default:
@@ -939,53 +5961,96 @@ enter_insert:
     }
 
     if (key != '.' && isprint(key)) {
-        save_nav_key = last_nav_key;
-        save_action  = key;
+        save_nav_key   = last_nav_key;
+        save_nav_count = last_nav_count;
+        save_action    = key;
+        save_op_motion = 0;
     }
 }
 
 void insert(int key) {
-    char key_str[32];
+    int           len;
+    char          c;
+    buffer_cache *cache;
+
+    TRACE_BEGIN("insert");
+
+    cache = active_sels();
+
+    if (cache != NULL && (key == ENTER || key == TAB)) {
+        /* With several cursors these are just text for flush_insert(). */
+        c = key == ENTER ? '\n' : '\t';
+        array_push(insert_pending, c);
+        goto out;
+    }
+
+    if (key == MBYTE || (key < 128 && isprint(key))) {
+        /*
+         * Plain text is collected and put in the buffer in one go
+         * (see flush_insert()) instead of one "insert" per key.
+         */
+        if (key == MBYTE) {
+            len = yed_get_glyph_len(&ys->mbyte);
+            array_push_n(insert_pending, ys->mbyte.bytes, len);
+            insert_pending_width += yed_get_glyph_width(&ys->mbyte);
+        } else {
+            c = key;
+            array_push(insert_pending, c);
+            insert_pending_width += 1;
+        }
+        goto out;
+    }
+
+    flush_insert();
+
+    if (cache != NULL
+    &&  key != BACKSPACE && key != ESC && key != CTRL_C) {
+        clear_sels(cache);
+    }
 
     switch (key) {
         case ARROW_LEFT:
-            YEXE("cursor-left");
+            XEXE(CMD_CURSOR_LEFT);
             break;
 
         case ARROW_DOWN:
-            YEXE("cursor-down");
+            XEXE(CMD_CURSOR_DOWN);
             break;
 
         case ARROW_UP:
-            YEXE("cursor-up");
+            XEXE(CMD_CURSOR_UP);
             break;
 
         case ARROW_RIGHT:
-            YEXE("cursor-right");
+            XEXE(CMD_CURSOR_RIGHT);
             break;
 
         case PAGE_UP:
-            YEXE("cursor-page-up");
+            XEXE(CMD_CURSOR_PAGE_UP);
             break;
 
         case PAGE_DOWN:
-            YEXE("cursor-page-down");
+            XEXE(CMD_CURSOR_PAGE_DOWN);
             break;
 
         case HOME_KEY:
-            YEXE("cursor-line-begin");
+            XEXE(CMD_CURSOR_LINE_BEGIN);
             break;
 
         case END_KEY:
-            YEXE("cursor-line-end");
+            XEXE(CMD_CURSOR_LINE_END);
             break;
 
         case BACKSPACE:
-            YEXE("delete-back");
+            if (cache != NULL) {
+                multi_backspace(cache);
+            } else {
+                XEXE(CMD_DELETE_BACK);
+            }
             break;
 
         case DEL_KEY:
-            YEXE("delete-forward");
+            XEXE(CMD_DELETE_FORWARD);
             break;
 
         case ESC:
@@ -994,17 +6059,134 @@ void insert(int key) {
             break;
 
         default:
-            if (key == ENTER || key == TAB || key == MBYTE || !iscntrl(key)) {
-                snprintf(key_str, sizeof(key_str), "%d", key);
-                YEXE("insert", key_str);
+            if (key == ENTER || key == TAB || !iscntrl(key)) {
+                XEXE(CMD_INSERT, key_string(key));
             } else {
                 yed_cerr("[INSERT] unhandled key %d", key);
             }
     }
 
+out:;
     if (mode == MODE_INSERT && !repeating) {
         array_push(insert_repeat_keys, key);
+        record_repeat_text(key);
+    }
+
+    TRACE_END("insert");
+}
+
+/*
+ * Keep the net text typed in this insert session so that '.' can put
+ * it in with one string insertion.  Anything but text (and BACKSPACE
+ * over text typed in this session) means the keys must be replayed.
+ */
+static void record_repeat_text(int key) {
+    char *data;
+    int   len;
+    char  c;
+
+    if (!repeat_text_ok) { return; }
+
+    if (key == MBYTE) {
+        array_push_n(repeat_text, ys->mbyte.bytes, yed_get_glyph_len(&ys->mbyte));
+        repeat_text_width += yed_get_glyph_width(&ys->mbyte);
+    } else if (key < 128 && isprint(key)) {
+        c = key;
+        array_push(repeat_text, c);
+        repeat_text_width += 1;
+    } else if (key == BACKSPACE && array_len(repeat_text)) {
+        data = array_data(repeat_text);
+        len  = array_len(repeat_text);
+        do { len -= 1; } while (len > 0 && (data[len] & 0xC0) == 0x80);
+        repeat_text_width -= yed_get_glyph_width((yed_glyph*)(data + len));
+        while (array_len(repeat_text) > len) {
+            array_pop(repeat_text);
+        }
+    } else {
+        repeat_text_ok = 0;
+    }
+}
+
+/* Redo the last insert session n times at the cursor. */
+static void replay_insert(int n) {
+    yed_frame  *frame;
+    yed_buffer *buff;
+    array_t     text;
+    int        *key_it;
+    int         i;
+
+    if (!repeat_text_ok) {
+        for (i = 0; i < n; i += 1) {
+            array_traverse(insert_repeat_keys, key_it) {
+                insert(*key_it);
+            }
+        }
+        return;
+    }
+
+    frame = ys->active_frame;
+
+    if (frame == NULL || frame->buffer == NULL)    { return; }
+    if (array_len(repeat_text) == 0)              { return; }
+
+    buff = frame->buffer;
+
+    if (buff->flags & BUFF_RD_ONLY) { return; }
+
+    text = array_make(char);
+    for (i = 0; i < n; i += 1) {
+        array_push_n(text, array_data(repeat_text), array_len(repeat_text));
+    }
+    array_zero_term(text);
+
+    yed_start_undo_record(frame, buff);
+    yed_buff_insert_string(buff, array_data(text), frame->cursor_line, frame->cursor_col);
+    yed_end_undo_record(frame, buff);
+
+    yed_set_cursor_within_frame(frame, frame->cursor_line, frame->cursor_col + (n * repeat_text_width));
+
+    array_free(text);
+}
+
+/*
+ * Put the text collected by insert() into the buffer as a single
+ * string insertion.  Called before any other insert mode key, before
+ * drawing, and when leaving insert.  The record opened here nests in
+ * the one enter_insert() holds open, so it adds none of its own.
+ */
+void flush_insert(void) {
+    yed_frame    *frame;
+    yed_buffer   *buff;
+    buffer_cache *cache;
+    char         *text;
+
+    if (array_len(insert_pending) == 0) { return; }
+
+    frame = ys->active_frame;
+
+    if (frame == NULL || frame->buffer == NULL) { goto out; }
+
+    buff = frame->buffer;
+
+    if (buff->flags & BUFF_RD_ONLY) { goto out; }
+
+    array_zero_term(insert_pending);
+
+    if ((cache = active_sels()) != NULL) {
+        text = array_data(insert_pending);
+        multi_insert(cache, &text, 1, 0, 0);
+        goto out;
     }
+
+    yed_start_undo_record(frame, buff);
+    yed_buff_insert_string(buff, array_data(insert_pending), frame->cursor_line, frame->cursor_col);
+    yed_end_undo_record(frame, buff);
+
+    yed_set_cursor_within_frame(frame, frame->cursor_line, frame->cursor_col + insert_pending_width);
+
+out:;
+    array_clear(insert_pending);
+    insert_pending_width = 0;
 }
 
 void enter_insert(void) {
@@ -1013,6 +6195,9 @@ void enter_insert(void) {
 
     if (!repeating) {
         array_clear(insert_repeat_keys);
+        array_clear(repeat_text);
+        repeat_text_width = 0;
+        repeat_text_ok    = 1;
     }
 
     frame = ys->active_frame;
@@ -1021,7 +6206,10 @@ void enter_insert(void) {
         buff = frame->buffer;
 
         if (buff) {
+            /* Everything up to exit_insert() is one undo record. */
             num_undo_records_before_insert = yed_get_undo_num_records(buff);
+            yed_start_undo_record(frame, buff);
+            insert_undo_buff = buff;
         }
     }
 
@@ -1033,19 +6221,17 @@ void enter_insert(void) {
 }
 
 void exit_insert(void) {
-    yed_frame  *frame;
     yed_buffer *buff;
 
-    frame = ys->active_frame;
-
-    if (frame) {
-        buff = frame->buffer;
+    flush_insert();
 
-        if (buff) {
+    if ((buff = insert_undo_buff) != NULL) {
+        insert_undo_buff = NULL;
+        yed_end_undo_record(ys->active_frame, buff);
 
-            while (yed_get_undo_num_records(buff) > num_undo_records_before_insert + 1) {
-                yed_merge_undo_records(buff);
-            }
+        /* c's delete is the record just before; make it the same change. */
+        if (yed_get_undo_num_records(buff) > num_undo_records_before_insert + 1) {
+            yed_merge_undo_records(buff);
         }
     }
 
@@ -1054,5 +6240,7 @@ void exit_insert(void) {
         yed_set_var("cursor-line", "yes");
         restore_cursor_line = 0;
     }
-    YEXE("select-lines");
+    if (active_sels() == NULL) {
+        select_cursor_line();
+    }
 }